@@ -8,9 +8,21 @@
 #include "cmd.h"
 #include "key.h"
 #include "config.h"
+#include "mc-eeprom.h"
 
 static uint8_t busy = 0;
 
+/* Programming jobs waiting for the key manager, the one at the tail is under way */
+#define PROGRAM_QUEUE_SIZE 8
+
+struct program_job {
+	uint8_t slot, flags;
+	struct key_info key;
+};
+
+static struct program_job program_queue[PROGRAM_QUEUE_SIZE];
+static uint8_t program_head, program_tail;
+
 static void help(char *argv[])
 {
 	printf_P(PSTR("\n\
@@ -18,6 +30,12 @@ static void help(char *argv[])
 \n\
 show_keys\n\
    Show currently plugged keys\n\
+bus_stats\n\
+   Show key bus statistics per position, to find worn jacks\n\
+stats\n\
+   Show how long scanning the keys takes and how many transfers fail\n\
+stats_reset\n\
+   Clear the scan and bus statistics\n\
 show_config\n\
    Print configuration (keyboard ID, expected keys) in a format that can be\n\
    directly fed back into the CLI\n\
@@ -41,6 +59,21 @@ program_key <position> <ID> <dfl timeout> <max timeout> <flags> <Name...>\n\
    flags - a combination of any of these letters:\n\
      B - Missing key causes keyboard to beep after timeout\n\
      R - Missing key causes rotating light to turn on occasionally\n\
+   Up to " __STRINGIFY__(PROGRAM_QUEUE_SIZE) " program_key/provision commands can be sent in a row. Each answers\n\
+   \"program <position>: queued\" right away and runs in the background, one\n\
+   after the other. Its result comes later as a single line, in between the\n\
+   output of other commands: \"program <position>: OK, ...\" or\n\
+   \"program <position>: Could not program: ...\".\n\
+provision <position> <steps> <ID> <dfl timeout> <max timeout> <flags> <Name...>\n\
+   Like program_key, with extra steps around it in one go. Steps are a\n\
+   combination of these letters, or - for none:\n\
+     E - Erase the whole key first\n\
+     P - Write protect the key when done. Use E or P to reprogram a\n\
+         protected key.\n\
+set_debounce empty|error|crc|valid <scans>\n\
+   Number of scans in a row a position has to show a new state before the\n\
+   keyboard takes it, 0 for the default. error is a failed read, crc a key\n\
+   with a broken record.\n\
 beeper on|off\n\
    Enable or disable the beeper, so it doesn't annoy you while you program keys\n\
 boot\n\
@@ -66,19 +99,30 @@ static uint8_t check_kb_setup(void)
 	return config.kb.id;
 }
 
+/* Resetting in the middle of programming would leave a half written key and drop the queue */
+static uint8_t check_programming_done(void)
+{
+	if (program_head != program_tail)
+		printf_P(PSTR("Busy programming keys, try again.\n"));
+	return program_head == program_tail;
+}
+
 static void boot(char *argv[])
 {
-	call_bootloader();
+	if (check_programming_done())
+		call_bootloader();
 }
 
 static void reset(char *argv[])
 {
-	reset_system();
+	if (check_programming_done())
+		reset_system();
 }
 
 static void test_mode(char *argv[])
 {
-	enter_test_mode();
+	if (check_programming_done())
+		enter_test_mode();
 }
 
 static void beeper(char *argv[])
@@ -94,10 +138,41 @@ static void beeper(char *argv[])
 	}
 }
 
-static void show_keys(char *argv[])
+static uint8_t show_slot;
+
+/* d is NULL if the names couldn't be fetched */
+static void show_valid_key(uint8_t slot, const struct key_eeprom_data *d)
+{
+	struct key_record *r = &keys[slot].rec;
+
+	printf_P(PSTR("ID %d (%s), timeout %d (max %d)%S%S"),
+			r->key_id, d ? d->key.name : "?",
+			r->dfl_timeout, r->max_timeout,
+			(r->flags & KF_BEEP) ? PSTR(", beep when gone") : PSTR(""),
+			(r->flags & KF_ROTLIGHT) ? PSTR(", rotate light when gone") : PSTR(""));
+	if (r->kb_id == config.kb.id)
+		printf_P(PSTR("\n"));
+	else
+		printf_P(PSTR(", belongs to keyboard ID %d (%s)\n"),
+				r->kb_id, d ? d->kb.name : "?");
+}
+
+static void show_keys_next(void);
+
+static void show_key_cb(uint8_t slot, uint8_t status, const struct key_eeprom_data *d)
+{
+	show_valid_key(slot, d);
+	show_slot++;
+	show_keys_next();
+}
+
+/* Slots only keep IDs, so the names of valid keys get fetched one after the other */
+static void show_keys_next(void)
 {
 	uint8_t i;
-	for (i = 0; i < MAX_KEYS; i++) {
+
+	for (; show_slot < MAX_KEYS; show_slot++) {
+		i = show_slot;
 		printf_P(PSTR("Position %d: "), i + 1);
 		if (keys[i].state == KS_UNKNOWN) {
 			printf_P(PSTR("ZOMG BUG!!!1one\n"));
@@ -107,19 +182,104 @@ static void show_keys(char *argv[])
 			printf_P(PSTR("Read error\n"));
 		} else if (keys[i].state == KS_CRC_ERROR) {
 			printf_P(PSTR("Bad checksum\n"));
+		} else if (key_fetch(i, show_key_cb)) {
+			return;
 		} else {
-			printf_P(PSTR("ID %d (%s), timeout %d (max %d)%S%S"),
-					keys[i].eep.key.id, keys[i].eep.key.name,
-					keys[i].eep.key.dfl_timeout, keys[i].eep.key.max_timeout,
-					(keys[i].eep.key.flags & KF_BEEP) ? PSTR(", beep when gone") : PSTR(""),
-					(keys[i].eep.key.flags & KF_ROTLIGHT) ? PSTR(", rotate light when gone") : PSTR(""));
-			if (keys[i].eep.kb.id == config.kb.id)
-				printf_P(PSTR("\n"));
-			else
-				printf_P(PSTR(", belongs to keyboard ID %d (%s)\n"),
-						keys[i].eep.kb.id, keys[i].eep.kb.name);
+			show_valid_key(i, NULL);
+		}
+	}
+	busy = 0;
+}
+
+static void show_keys(char *argv[])
+{
+	busy = 1;
+	show_slot = 0;
+	show_keys_next();
+}
+
+static void show_op_stats(const char *name, struct key_op_stats *op)
+{
+	printf_P(PSTR("  %S: %u ok, %u failed, %u retried, %u glitches, %lu bytes, failed at dev/cmd/addr/data %u/%u/%u/%u\n"),
+			name, op->ok, op->err, op->retries, op->glitches, op->bytes,
+			op->fail_at[0], op->fail_at[1], op->fail_at[2], op->fail_at[3]);
+}
+
+static void show_bus_stats(struct key_bus_stats *s)
+{
+	printf_P(PSTR(", %lu bits received, %u marginal\n"), s->rx_bits, s->rx_marginal);
+	show_op_stats(PSTR("read "), &s->op[KOP_READ]);
+	show_op_stats(PSTR("write"), &s->op[KOP_WRITE]);
+}
+
+static void bus_stats(char *argv[])
+{
+	uint8_t i;
+	for (i = 0; i < MAX_KEYS; i++) {
+		printf_P(PSTR("Position %d: %u byte EEPROM, bus speed %d"),
+				i + 1, (keys[i].eep_type < EEP_NUM_TYPES) ? eep_size(keys[i].eep_type) : 0,
+				keys[i].bus_speed);
+		if (KEY_BUS_STATS_PER_SLOT)
+			show_bus_stats(key_slot_stats(i));
+		else
+			printf_P(PSTR("\n"));
+	}
+	if (!KEY_BUS_STATS_PER_SLOT) {
+		printf_P(PSTR("All positions"));
+		show_bus_stats(key_stats);
+	}
+}
+
+static const char phase_names[][8] PROGMEM = {
+	[KPH_SELECT]  = "select",
+	[KPH_DETECT]  = "detect",
+	[KPH_ENABLE]  = "enable",
+	[KPH_XFER]    = "xfer",
+	[KPH_DISABLE] = "disable",
+};
+
+/* Timer ticks to us or ms, the ms timer runs at 1.024ms */
+static uint32_t ticks_to(uint32_t ticks, uint8_t ms)
+{
+	return ms ? ticks * 1024 / 1000 : ticks * 4;
+}
+
+static void show_time_stats(const char *name, const struct key_time_stats *t, uint8_t ms)
+{
+	printf_P(PSTR("  %-8S %lu/%lu/%lu %S, %u times\n"), name,
+			ticks_to(t->min, ms), t->count ? ticks_to(t->sum / t->count, ms) : 0, ticks_to(t->max, ms),
+			ms ? PSTR("ms") : PSTR("us"), t->count);
+}
+
+static void stats(char *argv[])
+{
+	uint32_t xfers = 0, errors = 0, glitches = 0, secs;
+	uint8_t i, j;
+
+	key_stats_update();
+	secs = key_scan_stats.elapsed / 977;  /* 1.024ms ticks, scaling the sum up first would overflow */
+
+	for (i = 0; i < KEY_BUS_STATS_SLOTS; i++) {
+		for (j = 0; j < KOP_NUM; j++) {
+			xfers += key_stats[i].op[j].ok + key_stats[i].op[j].err;
+			errors += key_stats[i].op[j].err;
+			glitches += key_stats[i].op[j].glitches;
 		}
 	}
+
+	printf_P(PSTR("Scan phases, min/avg/max:\n"));
+	for (i = 0; i < KPH_NUM; i++)
+		show_time_stats(phase_names[i], &key_scan_stats.phase[i], 0);
+	show_time_stats(PSTR("rotation"), &key_scan_stats.rotation, 1);
+
+	printf_P(PSTR("%lu transfers in %lu s, %lu/min, %lu failed (%lu per mille), %lu glitches\n"),
+			xfers, secs, secs ? xfers * 60 / secs : 0, errors, xfers ? errors * 1000 / xfers : 0, glitches);
+}
+
+static void stats_reset(char *argv[])
+{
+	key_stats_reset();
+	ok();
 }
 
 static uint8_t parse_key_args(char *argv[], uint8_t argi, struct key_info *data)
@@ -134,13 +294,30 @@ static uint8_t parse_key_args(char *argv[], uint8_t argi, struct key_info *data)
 	return (data->id != 0);
 }
 
-static void program_key_cb(uint8_t status)
+static void program_key_cb(uint8_t status, uint8_t pages_written, uint8_t pages_skipped);
+
+static void program_next(void)
 {
-	busy = 0;
+	struct program_job *job = program_queue + (program_tail & (PROGRAM_QUEUE_SIZE - 1));
+	struct key_eeprom_data data;
+
+	if (program_head == program_tail)
+		return;
+
+	memset(&data, 0, sizeof(data));
+	data.key = job->key;
+	data.kb = config.kb;
+	key_program(job->slot, &data, job->flags, program_key_cb);
+}
+
+static void program_key_cb(uint8_t status, uint8_t pages_written, uint8_t pages_skipped)
+{
+	/* Results come in between other commands' output, so they get their own prefix */
+	printf_P(PSTR("program %d: "), program_queue[program_tail & (PROGRAM_QUEUE_SIZE - 1)].slot + 1);
 
 	switch (status) {
 	case KS_VALID:
-		ok();
+		printf_P(PSTR("OK, %d pages written, %d unchanged\n"), pages_written, pages_skipped);
 		break;
 	case KS_EMPTY:
 		printf_P(PSTR("Could not program: No key plugged\n"));
@@ -148,12 +325,18 @@ static void program_key_cb(uint8_t status)
 	case KS_READ_ERROR:
 		printf_P(PSTR("Could not program: Transmission failed\n"));
 		break;
+	case KS_CRC_ERROR:
+		printf_P(PSTR("Could not program: Verify failed, key write protected?\n"));
+		break;
 	}
+
+	program_tail++;
+	program_next();
 }
 
-static void program_key(char *argv[])
+static void start_program(char *argv[], uint8_t argi, uint8_t flags)
 {
-	struct key_eeprom_data data;
+	struct program_job *job = program_queue + (program_head & (PROGRAM_QUEUE_SIZE - 1));
 	uint8_t slot = atoi(argv[1]);
 
 	if (!check_kb_setup())
@@ -164,17 +347,35 @@ static void program_key(char *argv[])
 		return;
 	}
 
-	memset(&data, 0, sizeof(data));
-	if (!parse_key_args(argv, 2, &data.key)) {
+	if ((uint8_t)(program_head - program_tail) == PROGRAM_QUEUE_SIZE) {
+		printf_P(PSTR("Queue full, try again.\n"));
+		return;
+	}
+
+	memset(job, 0, sizeof(*job));
+	if (!parse_key_args(argv, argi, &job->key)) {
 		printf_P(PSTR("Bad key data specified\n"));
 		return;
 	}
+	job->slot = slot - 1;
+	job->flags = flags;
+	printf_P(PSTR("program %d: queued\n"), slot);
 
-	data.kb = config.kb;
-	busy = 1;
-	key_program(slot - 1, &data, program_key_cb);
+	/* Start right away unless another job is under way, that one will start this when done */
+	if ((uint8_t)(program_head++ - program_tail) == 0)
+		program_next();
 
-	/* Success/fail message will come from callback */
+	/* Result line will come from callback */
+}
+
+static void program_key(char *argv[])
+{
+	start_program(argv, 2, 0);
+}
+
+static void provision(char *argv[])
+{
+	start_program(argv, 3, (strchr(argv[2], 'E') ? KP_ERASE : 0) | (strchr(argv[2], 'P') ? KP_PROTECT : 0));
 }
 
 static void add_key(char *argv[])
@@ -232,6 +433,54 @@ static void clear_keys(char *argv[])
 	ok();
 }
 
+/*
+ * Captured keys go straight to the EEPROM copy of the config. config.keys[] stays as it is
+ * until all could be read, so the key checks never see a half captured config.
+ */
+static uint8_t capture_slot;
+
+static void capture_keys_next(void);
+
+static void capture_key_cb(uint8_t slot, uint8_t status, const struct key_eeprom_data *d)
+{
+	if (status != KS_VALID) {
+		printf_P(PSTR("Key in position %d could not be read\n"), slot + 1);
+		/* Undo the slots written so far */
+		save_config();
+		busy = 0;
+		return;
+	}
+
+	save_config_key(slot, &d->key);
+	capture_slot++;
+	capture_keys_next();
+}
+
+/* The names have to come from the keys, so fetch the valid ones one after the other */
+static void capture_keys_next(void)
+{
+	struct key_info empty;
+
+	memset(&empty, 0, sizeof(empty));
+	for (; capture_slot < MAX_KEYS; capture_slot++) {
+		if (keys[capture_slot].state != KS_VALID) {
+			save_config_key(capture_slot, &empty);
+			continue;
+		}
+		if (!key_fetch(capture_slot, capture_key_cb)) {
+			printf_P(PSTR("Busy, try again.\n"));
+			save_config();
+			busy = 0;
+		}
+		return;
+	}
+
+	load_config();
+	config_changed = 1;
+	busy = 0;
+	ok();
+}
+
 static void capture_keys(char *argv[])
 {
 	uint8_t slot, i;
@@ -242,28 +491,23 @@ static void capture_keys(char *argv[])
 	for (slot = 0; slot < MAX_KEYS; slot++) {
 		if (!(
 				(keys[slot].state == KS_EMPTY) ||
-				((keys[slot].state == KS_VALID) && (keys[slot].eep.kb.id == config.kb.id))
+				((keys[slot].state == KS_VALID) && (keys[slot].rec.kb_id == config.kb.id))
 			)) {
 			printf_P(PSTR("Key in position %d is not valid\n"), slot + 1);
 			return;
 		}
 		for (i = 0; i < slot; i++) {
 			if (keys[i].state == KS_VALID && keys[slot].state == KS_VALID &&
-					keys[i].eep.key.id == keys[slot].eep.key.id) {
+					keys[i].rec.key_id == keys[slot].rec.key_id) {
 				printf_P(PSTR("Duplicate key ID in positions %d and %d\n"), i + 1, slot + 1);
 				return;
 			}
 		}
 	}
 
-	memset(config.keys, 0, sizeof(config.keys));
-	for (slot = 0; slot < MAX_KEYS; slot++) {
-		if (keys[slot].state == KS_VALID)
-			config.keys[slot] = keys[slot].eep.key;
-	}
-	save_config();
-
-	ok();
+	busy = 1;
+	capture_slot = 0;
+	capture_keys_next();
 }
 
 static void set_keyboard(char *argv[])
@@ -275,6 +519,41 @@ static void set_keyboard(char *argv[])
 	ok();
 }
 
+/* Key states as named by set_debounce */
+static const char debounce_states[][6] PROGMEM = {
+	[KS_EMPTY]      = "empty",
+	[KS_READ_ERROR] = "error",
+	[KS_CRC_ERROR]  = "crc",
+	[KS_VALID]      = "valid",
+};
+
+static void set_debounce(char *argv[])
+{
+	uint8_t state;
+	long scans;
+	char *end;
+
+	for (state = KS_EMPTY; state <= KS_VALID; state++)
+		if (!strcmp_P(argv[1], debounce_states[state]))
+			break;
+
+	if (state > KS_VALID) {
+		printf_P(PSTR("Invalid state\n"));
+		return;
+	}
+
+	/* 0xFF is taken by erased EEPROM, so it means the default just like 0 */
+	scans = strtol(argv[2], &end, 10);
+	if (end == argv[2] || *end || scans < 0 || scans > 254) {
+		printf_P(PSTR("Invalid number of scans, use 1..254 or 0 for the default\n"));
+		return;
+	}
+
+	config.debounce[state] = scans;
+	save_config();
+	ok();
+}
+
 static void show_config(char *argv[])
 {
 	int i;
@@ -296,6 +575,9 @@ static void show_config(char *argv[])
 			   (k->flags & KF_ROTLIGHT) ? "R" : "", k->name);
 	}
 
+	for (i = KS_EMPTY; i <= KS_VALID; i++)
+		printf_P(PSTR("set_debounce %S %d\n"), debounce_states[i], config_debounce(i));
+
 	printf_P(PSTR("# END Keyboard v2 config dump\n"));
 }
 
@@ -338,6 +620,9 @@ static const PROGMEM struct cmd_def commands[] = {
 		{ "reset",        reset, 0 },
 		{ "beeper",       beeper, 1 },
 		{ "show_keys",    show_keys, 0 },
+		{ "bus_stats",    bus_stats, 0 },
+		{ "stats",        stats, 0 },
+		{ "stats_reset",  stats_reset, 0 },
 		{ "show_config",  show_config, 0 },
 		{ "set_keyboard", set_keyboard, 2 },
 		{ "add_key",      add_key, 5 },
@@ -345,6 +630,8 @@ static const PROGMEM struct cmd_def commands[] = {
 		{ "clear_keys",   clear_keys, 0 },
 		{ "capture_keys", capture_keys, 0 },
 		{ "program_key",  program_key, 6 },
+		{ "provision",    provision, 7 },
+		{ "set_debounce", set_debounce, 2 },
 		/* Test mode commands after this line */
 		{ "set_slot",     set_slot, 1 },
 		{ "scan_key",     scan_key, 0 },
@@ -352,7 +639,7 @@ static const PROGMEM struct cmd_def commands[] = {
 		{ "key_power",    key_power, 1 },
 };
 
-#define NUM_USER_COMMANDS 14
+#define NUM_USER_COMMANDS 19
 
 void handle_command(char *cmd)
 {
@@ -1,6 +1,9 @@
 #include <avr/wdt.h>
+#include <util/crc16.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include "common.h"
+#include "key.h"
+#include "key_timer.h"
 
 uint8_t event_queue[EVENT_QUEUE_SIZE];
 volatile uint8_t event_queue_head = 0, event_queue_tail = 0;
@@ -36,6 +39,7 @@ uint8_t get_event(void)
 
 uint32_t boot_key ATTR_NO_INIT;
 uint8_t g_test_mode ATTR_NO_INIT;
+uint8_t g_warm_start ATTR_NO_INIT;
 
 #define BOOT_KEY_MAGIC  0xCAFEBABE
 #define TEST_MODE_MAGIC 0xABADF00D
@@ -52,13 +56,31 @@ void bootloader_check(void)
 		((void (*)(void))BOOTLOADER_START_ADDRESS)();
 	}
 	g_test_mode = ((MCUSR & (1 << WDRF)) && (boot_key == TEST_MODE_MAGIC));
+	g_warm_start = !!(MCUSR & (1 << WDRF));
 	boot_key = 0;
 }
 
+uint16_t warm_state_crc(const void *data, uint16_t size)
+{
+	uint16_t crc = 0xFFFF;
+	const uint8_t *p = data;
+
+	while (size--)
+		crc = _crc16_update(crc, *p++);
+
+	/* Don't let a firmware update take over contents it may lay out differently */
+	for (p = (const uint8_t *)FW_VERSION; *p; p++)
+		crc = _crc16_update(crc, *p);
+
+	return crc;
+}
+
 void watchdog_reset(uint8_t where)
 {
 	USB_Disable();
 	cli();
+	key_save_state();
+	timers_save_state();
 
 	if (where == WDR_BOOTLOADER)
 		boot_key = BOOT_KEY_MAGIC;
@@ -40,11 +40,27 @@ uint8_t get_event(void);
 extern volatile uint8_t global_ms_timer;
 extern volatile uint8_t global_qs_timer;
 
+/*
+ * Timestamps to measure how long things take. The ms timer counts global_ms_timer ticks (1.024ms)
+ * and wraps after about a minute, the fine timer counts 4us ticks and wraps after 262ms.
+ */
+uint16_t get_ms_timer(void);
+uint16_t get_fine_timer(void);
+
 static inline uint8_t in_test_mode(void) {
 	extern uint8_t g_test_mode;
 	return g_test_mode;
 }
 
+/* Reset by the watchdog, e.g. from reset_system(), rather than power up or the reset pin */
+static inline uint8_t warm_start(void) {
+	extern uint8_t g_warm_start;
+	return g_warm_start;
+}
+
+/* CRC to seal state kept across a watchdog reset, see key_save_state() */
+uint16_t warm_state_crc(const void *data, uint16_t size);
+
 #define WDR_RESET      0
 #define WDR_BOOTLOADER 1
 #define WDR_TESTMODE   2
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include "config.h"
 
 struct config config;
@@ -13,6 +14,11 @@ void save_config(void)
 	config_changed = 1;
 }
 
+void save_config_key(uint8_t idx, const struct key_info *key)
+{
+	eeprom_update_block(key, &config_eep.keys[idx], sizeof(*key));
+}
+
 void load_config(void)
 {
 	eeprom_read_block(&config, &config_eep, sizeof(config));
@@ -22,6 +28,26 @@ void load_config(void)
 		memset(&config, 0, sizeof(config));
 }
 
+/*
+ * A record that passed its CRC is as good as it gets, so it shows up on the first scan.
+ * Empty slots and errors can come from a wiggling plug and have to be seen a few times in a row.
+ */
+static const uint8_t PROGMEM debounce_default[KS_VALID + 1] = {
+	[KS_EMPTY]      = 3,
+	[KS_READ_ERROR] = 3,
+	[KS_CRC_ERROR]  = 3,
+	[KS_VALID]      = 1,
+};
+
+uint8_t config_debounce(uint8_t state)
+{
+	uint8_t n = config.debounce[state];
+
+	if (!n || n == 0xFF)
+		n = pgm_read_byte(&debounce_default[state]);
+	return n;
+}
+
 int8_t find_key(uint8_t id)
 {
 	uint8_t i;
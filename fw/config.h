@@ -7,13 +7,21 @@
 struct config {
 	struct kb_info  kb;
 	struct key_info keys[MAX_KEYS];
+	/* Consecutive scans needed to commit a slot to each key state, 0 or 0xFF for the default */
+	uint8_t debounce[KS_VALID + 1];
 };
 
+uint8_t config_debounce(uint8_t state);
+
 extern struct config config;
 extern uint8_t config_changed;
 
 void save_config(void);
 void load_config(void);
+/**
+ * Write one key to the stored config only, config.keys[] picks it up with the next load_config()
+ */
+void save_config_key(uint8_t idx, const struct key_info *key);
 
 /**
  * Search for a key with ID id in the configuration
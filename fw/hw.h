@@ -18,7 +18,27 @@ struct bits {
 
 #define SHIFTREG_LATCH SBIT(PORTF, 0)
 
+/*
+ * Key slots come in banks of 8, each bank with its own slot select/enable and LED shift registers.
+ * The main board has the first bank, extension boards hang off the end of its shift register chain.
+ */
+#ifndef MAX_KEYS
 #define MAX_KEYS 8
+#endif
+#if MAX_KEYS > 16
+#error "More than 16 key slots don't fit: the per-slot state would outgrow the 2.5KB SRAM"
+#elif MAX_KEYS != 8 && MAX_KEYS != 16
+#error "MAX_KEYS must be 8 or 16"
+#endif
+#define KEY_BANKS (MAX_KEYS / 8)
+
+/* One bit per slot */
+#if MAX_KEYS <= 8
+typedef uint8_t key_mask_t;
+#else
+typedef uint16_t key_mask_t;
+#endif
+#define KEY_MASK_ALL ((key_mask_t)(((uint32_t)1 << MAX_KEYS) - 1))
 
 #define LCD_LED   OCR1B
 #define SMAUL_LED OCR1A
@@ -33,11 +53,29 @@ struct bits {
 #define IN_SMAUL (1 << PE2)
 #define IN_PUSH  (1 << PB4)
 
-struct shiftregs {
+/* Shift registers of one bank. Only the main board connects rotlight and beeper. */
+struct shiftreg_bank {
 	uint8_t key_sel:3, key_en:1, rotlight:1, beeper:1, nc:2;
 	uint8_t leds;
 };
 
+/*
+ * Banks in the order they get shifted out, far end of the chain first, so bank[KEY_BANKS - 1] is the
+ * main board. Its fields are also available by name, as shiftregs.beeper etc.
+ */
+struct shiftregs {
+	union {
+		struct shiftreg_bank bank[KEY_BANKS];
+		struct {
+#if KEY_BANKS > 1
+			struct shiftreg_bank ext[KEY_BANKS - 1];
+#endif
+			uint8_t key_sel:3, key_en:1, rotlight:1, beeper:1, nc:2;
+			uint8_t leds;
+		};
+	};
+};
+
 #define min(x,y)  ((x)<(y) ? (x) : (y))
 #define max(x,y)  ((x)>(y) ? (x) : (y))
 
@@ -1,11 +1,15 @@
 #include <string.h>
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <util/crc16.h>
+#include <LUFA/Common/Common.h>
 #include "common.h"
 #include "panel.h"
 #include "key.h"
+#include "config.h"
 #include "onewire.h"
 #include "mc-eeprom.h"
 
@@ -19,30 +23,163 @@ enum keymgr_state {
 	KMS_XFER_ERR = 6,
 	KMS_DISABLE  = 7,
 	KMS_WAIT     = 8,
+	KMS_PROBE    = 9,
+	KMS_PROBE_OK = 10,
+	KMS_PROGRAM  = 11,
+};
+
+/* Programming chain, steps the flags don't ask for are skipped */
+enum program_step {
+	PS_START = 0,
+	PS_UNPROTECT,
+	PS_ERASE,
+	PS_WRITE,
+	PS_VERIFY,
+	PS_PROTECT,
+	PS_DONE,
 };
 
 static uint8_t current_key = 0;
 static uint8_t keymgr_state;
 static uint8_t wait_ms;
+static uint8_t xfer_speed;
+static uint8_t xfer_size;
+static uint8_t sig_read;
+static uint8_t scan_settled;  /* Nothing changed or went wrong while scanning current_key */
+static uint8_t boot_sweep;    /* First round after reset, only detecting which slots have a plug */
+static uint16_t key_sig;
 
 static uint8_t programming = 0;
+static uint8_t program_pending = 0;
+static uint8_t program_slot;
+static uint8_t program_flags;
+static uint8_t program_step;
+static uint8_t program_status;
 static key_program_cb program_cb;
+static struct key_eeprom_data program_data;
+
+/* Fetches wait here for the bus, each caller has at most one of them */
+#define KEY_FETCH_QUEUE_SIZE 4
+struct key_fetch_req {
+	uint8_t slot;
+	key_fetch_cb cb;
+};
+static struct key_fetch_req fetch_queue[KEY_FETCH_QUEUE_SIZE];
+static uint8_t fetch_head, fetch_tail;
+static uint8_t fetching = 0;
+static key_fetch_cb fetch_cb;
+
+#define KEY_CHANGE_QUEUE_SIZE 8
+static struct key_change change_queue[KEY_CHANGE_QUEUE_SIZE];
+static uint8_t change_head, change_tail, changes_lost;
 
 struct key_eeprom_data key_xfer_data;
 
-struct key_socket keys[MAX_KEYS];
+/*
+ * keys[] survives watchdog resets. watchdog_reset() seals it with a CRC, so after a reset the
+ * firmware asked for, key_init() can start out with what the slots held before.
+ */
+struct key_socket keys[MAX_KEYS] ATTR_NO_INIT;
+static uint16_t keys_crc ATTR_NO_INIT;
+struct key_bus_stats key_stats[KEY_BUS_STATS_SLOTS];
+struct key_scan_stats key_scan_stats;
+
+/* Scan phase each state belongs to, KPH_NUM for none */
+static const uint8_t PROGMEM kms_phase[] = {
+	[KMS_IDLE]     = KPH_NUM,
+	[KMS_SELECT]   = KPH_SELECT,
+	[KMS_DETECT]   = KPH_DETECT,
+	[KMS_ENABLE]   = KPH_ENABLE,
+	[KMS_XFER]     = KPH_XFER,
+	[KMS_XFER_OK]  = KPH_XFER,
+	[KMS_XFER_ERR] = KPH_XFER,
+	[KMS_DISABLE]  = KPH_DISABLE,
+	[KMS_WAIT]     = KPH_NUM,
+	[KMS_PROBE]    = KPH_XFER,
+	[KMS_PROBE_OK] = KPH_XFER,
+	[KMS_PROGRAM]  = KPH_NUM,
+};
+
+static uint8_t stats_phase = KPH_NUM;
+static uint8_t stats_last_slot;
+static uint8_t stats_rotation_started;
+static uint16_t stats_phase_start, stats_rotation_start, stats_last_ms;
 
 static inline void idle(void)
 {
 	keymgr_state = in_test_mode() ? KMS_WAIT : KMS_IDLE;
 }
 
+static void key_clear_slot(struct key_socket *k)
+{
+	k->bus_speed = OW_SPEED_DEFAULT;
+	k->bus_speed_fail = 0;
+	k->eep_type = EEP_TYPE_UNKNOWN;
+}
+
+void key_save_state(void)
+{
+	keys_crc = warm_state_crc(keys, sizeof(keys));
+}
+
 void key_init(void)
 {
-	memset(&keys, 0, sizeof(keys));
+	uint8_t i;
+
+	key_stats_reset();
+	current_key = MAX_KEYS - 1;  /* Start scanning at slot 0 */
+
+	if (warm_start() && keys_crc == warm_state_crc(keys, sizeof(keys))) {
+		/* Keep the states from before the reset, the first scan of every slot confirms them */
+		for (i = 0; i < MAX_KEYS; i++) {
+			keys[i].new_state = keys[i].state;
+			keys[i].new_state_debounce = 0;
+			keys[i].scan_interval = 0;
+		}
+		boot_sweep = 0;
+		changes_lost = 1;
+		push_event(EV_KEY_CHANGE);
+	} else {
+		memset(&keys, 0, sizeof(keys));
+		for (i = 0; i < MAX_KEYS; i++)
+			key_clear_slot(keys + i);
+		boot_sweep = 1;
+	}
+	/* Only good for the reset it was sealed for */
+	keys_crc = ~keys_crc;
+
 	idle();
 }
 
+static void post_change(uint8_t old_state, uint8_t new_state)
+{
+	struct key_change *c;
+
+	if ((uint8_t)(change_head - change_tail) == KEY_CHANGE_QUEUE_SIZE) {
+		changes_lost = 1;
+	} else {
+		c = change_queue + (change_head++ & (KEY_CHANGE_QUEUE_SIZE - 1));
+		c->slot = current_key;
+		c->old_state = old_state;
+		c->new_state = new_state;
+	}
+	push_event(EV_KEY_CHANGE);
+}
+
+uint8_t key_get_change(struct key_change *c)
+{
+	if (changes_lost) {
+		changes_lost = 0;
+		change_tail = change_head;
+		return KC_ALL;
+	}
+	if (change_head == change_tail)
+		return KC_NONE;
+
+	*c = change_queue[change_tail++ & (KEY_CHANGE_QUEUE_SIZE - 1)];
+	return KC_SLOT;
+}
+
 void key_test_sel_slot(uint8_t slot)
 {
 	current_key = slot;
@@ -59,11 +196,37 @@ static void key_xfer_cb(uint8_t success)
 	keymgr_state = success ? KMS_XFER_OK : KMS_XFER_ERR;
 }
 
+static void key_step_cb(uint8_t success)
+{
+	if (!success)
+		ow_disconnect();
+	keymgr_state = success ? KMS_PROGRAM : KMS_XFER_ERR;
+}
+
+static void key_probe_cb(uint8_t success)
+{
+	if (!success)
+		ow_disconnect();
+	keymgr_state = success ? KMS_PROBE_OK : KMS_XFER_ERR;
+}
+
+/* Call with interrupts off */
+static void key_disable_banks(void)
+{
+	uint8_t bank;
+
+	for (bank = 0; bank < KEY_BANKS; bank++)
+		shiftreg_bank(bank)->key_en = 1; // note negative logic
+}
+
 static void key_select(void)
 {
+	struct shiftreg_bank *bank = shiftreg_bank(current_key / 8);
+
 	cli();
-	shiftregs.key_sel = current_key;
-	shiftregs.key_en  = 0; // note negative logic
+	key_disable_banks();
+	bank->key_sel = current_key % 8;
+	bank->key_en  = 0; // note negative logic
 	sei();
 	shiftreg_update();
 }
@@ -71,7 +234,7 @@ static void key_select(void)
 static void key_deselect(void)
 {
 	cli();
-	shiftregs.key_en = 1; // note negative logic
+	key_disable_banks();
 	sei();
 	shiftreg_update();
 }
@@ -107,7 +270,11 @@ void key_test_power_key(uint8_t enable)
 static void key_disable_and_next(void)
 {
 	key_power_off();
+	/* Have a look at freshly programmed keys soon */
+	if (programming)
+		scan_settled = 0;
 	programming = 0;
+	fetching = 0;
 	wait_ms = global_ms_timer;
 	keymgr_state = KMS_DISABLE;
 }
@@ -116,48 +283,295 @@ static void set_key_state(uint8_t state)
 {
 	struct key_socket *k = keys + current_key;
 
-	if (k->state != state) {
-		if (k->new_state != state) {
-			k->new_state = state;
-			k->new_state_debounce = 2;
-		} else {
-			if (!(--k->new_state_debounce)) {
-				push_event(EV_KEY_CHANGE);
-				k->state = state;
-			}
-		}
+	if (k->state != state || state == KS_READ_ERROR || state == KS_CRC_ERROR)
+		scan_settled = 0;
+
+	/*
+	 * Nothing to debounce against right after reset. Trust an empty slot or a valid record
+	 * right away, so the keyboard shows the right status quickly.
+	 */
+	if (k->state == KS_UNKNOWN && (state == KS_EMPTY || state == KS_VALID)) {
+		post_change(k->state, state);
+		k->state = k->new_state = state;
+		return;
+	}
+
+	/* Every scan that doesn't confirm a pending state starts its count over */
+	if (k->state == state) {
+		k->new_state = state;
+		return;
 	}
+
+	if (k->new_state != state) {
+		k->new_state = state;
+		k->new_state_debounce = config_debounce(state);
+	}
+	if (!(--k->new_state_debounce)) {
+		post_change(k->state, state);
+		k->state = state;
+	}
+}
+
+/*
+ * Bus speed for the next transfer. Scans probe one step above the verified speed
+ * until a speed fails; programming sticks to what is known to work.
+ */
+static uint8_t key_bus_speed(void)
+{
+	struct key_socket *k = keys + current_key;
+	uint8_t limit = k->bus_speed_fail ?: OW_NUM_SPEEDS;
+
+	if (!programming && !fetching && k->bus_speed + 1 < limit)
+		return k->bus_speed + 1;
+	return k->bus_speed;
+}
+
+/*
+ * Transfer at xfer_speed failed. Returns 1 if the failure is to be blamed on the bus speed,
+ * in which case the speed is lowered and the next scan tries again.
+ */
+static uint8_t key_bus_speed_failed(void)
+{
+	struct key_socket *k = keys + current_key;
+
+	if (!xfer_speed || programming || fetching)
+		return 0;
+
+	scan_settled = 0;
+	k->bus_speed_fail = xfer_speed;
+	if (k->bus_speed >= xfer_speed)
+		k->bus_speed = xfer_speed - 1;
+	key_slot_stats(current_key)->op[KOP_READ].retries++;
+	return 1;
 }
 
-static uint16_t calc_key_crc(void)
+static void key_count_xfer(uint8_t success)
+{
+	struct key_bus_stats *s = key_slot_stats(current_key);
+	struct key_op_stats *op = s->op + (programming ? KOP_WRITE : KOP_READ);
+
+	op->glitches += eep_retries();
+	if (success) {
+		op->ok++;
+		op->bytes += xfer_size;
+	} else {
+		op->err++;
+		op->fail_at[eep_fail_pos()]++;
+	}
+
+	s->rx_bits += ow_rx_bits;
+	s->rx_marginal += ow_rx_marginal;
+}
+
+static void key_read(uint8_t addr, uint8_t size, void *buf)
+{
+	xfer_size = size;
+	eep_read(addr, size, buf, key_xfer_cb);
+	keymgr_state = KMS_XFER;
+}
+
+static uint16_t calc_key_crc(const struct key_eeprom_data *d)
 {
 	uint16_t crc = 0xFFFF;
 	uint8_t i;
 
-	uint8_t *data = (uint8_t *)&key_xfer_data;
+	const uint8_t *data = (const uint8_t *)d;
 
-	for (i = 0; i < sizeof(key_xfer_data) - sizeof(crc); i++)
+	for (i = 0; i < sizeof(*d) - sizeof(crc); i++)
 		crc = _crc16_update(crc, data[i]);
 
 	return crc;
 }
 
+/* CRC was accumulated while reading, over the data and the stored CRC */
 static uint8_t key_validate(void)
 {
-	return calc_key_crc() == key_xfer_data.crc16;
+	return ow_crc() == 0;
 }
 
-void key_program(uint8_t slot, struct key_eeprom_data *data, key_program_cb cb)
+/* Start the next step of the programming chain, the key stays powered in between */
+static void key_program_next(void)
 {
-	/* Abort whatever the key manager was just in the process of doing */
-	eep_abort();
-	key_power_off();
-	idle();
-	current_key = slot;
+	keymgr_state = KMS_XFER;
+
+	while (++program_step < PS_DONE) {
+		switch (program_step) {
+		case PS_UNPROTECT:
+			/* Protection blocks writing and erasing, plain programming doesn't pay for lifting it */
+			if (!(program_flags & (KP_ERASE | KP_PROTECT)))
+				continue;
+			eep_protect(EEP_PROT_NONE, key_step_cb);
+			return;
+		case PS_ERASE:
+			if (!(program_flags & KP_ERASE))
+				continue;
+			eep_erase(EEP_ERASE_FF, key_step_cb);
+			return;
+		case PS_WRITE:
+			/* Reprogramming mostly changes a few fields, leave the pages that match alone */
+			xfer_size = sizeof(program_data);
+			eep_update(0, sizeof(program_data), &program_data, key_step_cb);
+			return;
+		case PS_VERIFY:
+			eep_read(0, sizeof(key_xfer_data), &key_xfer_data, key_step_cb);
+			return;
+		case PS_PROTECT:
+			if (!(program_flags & KP_PROTECT))
+				continue;
+			eep_protect(EEP_PROT_ALL, key_step_cb);
+			return;
+		}
+	}
+
+	program_status = KS_VALID;
+	ow_disconnect();
+	keymgr_state = KMS_XFER_OK;
+}
+
+/*
+ * The key manager finishes the slot it is at and picks the request up before moving on,
+ * so the scan in flight doesn't get cut off.
+ */
+void key_program(uint8_t slot, struct key_eeprom_data *data, uint8_t flags, key_program_cb cb)
+{
+	program_slot = slot;
+	program_flags = flags;
 	program_cb = cb;
-	programming = 1;
-	key_xfer_data = *data;
-	key_xfer_data.crc16 = calc_key_crc();
+	program_data = *data;
+	program_data.crc16 = calc_key_crc(&program_data);
+	program_pending = 1;
+}
+
+uint8_t key_fetch(uint8_t slot, key_fetch_cb cb)
+{
+	struct key_fetch_req *f;
+	uint8_t i;
+
+	/* A caller that is still waiting only wants the slot it asked for last */
+	for (i = fetch_tail; i != fetch_head; i++) {
+		f = fetch_queue + (i & (KEY_FETCH_QUEUE_SIZE - 1));
+		if (f->cb == cb) {
+			f->slot = slot;
+			return 1;
+		}
+	}
+
+	if ((uint8_t)(fetch_head - fetch_tail) == KEY_FETCH_QUEUE_SIZE)
+		return 0;
+
+	f = fetch_queue + (fetch_head++ & (KEY_FETCH_QUEUE_SIZE - 1));
+	f->slot = slot;
+	f->cb = cb;
+	return 1;
+}
+
+/* The callback may start the next fetch right away */
+static void key_fetch_done(uint8_t status)
+{
+	/* Not what the slot went by, have the next round look at it */
+	if (status != KS_VALID)
+		scan_settled = 0;
+	fetching = 0;
+	fetch_cb(current_key, status, (status == KS_VALID) ? &key_xfer_data : NULL);
+}
+
+static void key_set_record(struct key_record *r, const struct key_eeprom_data *d)
+{
+	r->key_id = d->key.id;
+	r->kb_id = d->kb.id;
+	r->dfl_timeout = d->key.dfl_timeout;
+	r->max_timeout = d->key.max_timeout;
+	r->flags = d->key.flags;
+	r->crc16 = d->crc16;
+}
+
+/*
+ * Slots where something happened get scanned every round until they settle,
+ * then the interval doubles with every scan that reads the same.
+ */
+static void key_reschedule(struct key_socket *k)
+{
+	if (!scan_settled)
+		k->scan_interval = 0;
+	else if (!k->scan_interval)
+		k->scan_interval = 1;
+	else
+		k->scan_interval = min(k->scan_interval * 2, KEY_SCAN_MAX_INTERVAL);
+}
+
+/* Move on to the next slot due for a scan, if any */
+static uint8_t key_next_due(void)
+{
+	uint8_t i, slot = current_key;
+
+	for (i = 0; i < MAX_KEYS; i++) {
+		slot = (slot >= MAX_KEYS - 1) ? 0 : (slot + 1);
+		if ((uint8_t)(global_qs_timer - keys[slot].last_scan) >= keys[slot].scan_interval) {
+			current_key = slot;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void time_stats_add(struct key_time_stats *t, uint16_t time)
+{
+	if (t->count == 0xFFFF)
+		return;
+	if (!t->count || time < t->min)
+		t->min = time;
+	if (time > t->max)
+		t->max = time;
+	t->sum += time;
+	t->count++;
+}
+
+void key_stats_update(void)
+{
+	uint16_t now = get_ms_timer();
+
+	key_scan_stats.elapsed += (uint16_t)(now - stats_last_ms);
+	stats_last_ms = now;
+}
+
+void key_stats_reset(void)
+{
+	memset(&key_stats, 0, sizeof(key_stats));
+	memset(&key_scan_stats, 0, sizeof(key_scan_stats));
+	stats_rotation_started = 0;
+	stats_last_ms = get_ms_timer();
+}
+
+/* A scan of a slot not past the previous one starts the next pass over the slots */
+static void key_time_rotation(void)
+{
+	uint16_t now;
+
+	if (current_key <= stats_last_slot) {
+		now = get_ms_timer();
+		if (stats_rotation_started)
+			time_stats_add(&key_scan_stats.rotation, now - stats_rotation_start);
+		stats_rotation_start = now;
+		stats_rotation_started = 1;
+		key_stats_update();
+	}
+	stats_last_slot = current_key;
+}
+
+/* Charge the time since the last change of phase to the phase left */
+static void key_time_phase(void)
+{
+	uint8_t phase = (programming || fetching) ? KPH_NUM : pgm_read_byte(&kms_phase[keymgr_state]);
+	uint16_t now;
+
+	if (phase == stats_phase)
+		return;
+
+	now = get_fine_timer();
+	if (stats_phase < KPH_NUM)
+		time_stats_add(&key_scan_stats.phase[stats_phase], now - stats_phase_start);
+	stats_phase = phase;
+	stats_phase_start = now;
 }
 
 static inline uint8_t wait_done(uint8_t ms)
@@ -169,7 +583,7 @@ static inline uint8_t wait_done(uint8_t ms)
 void key_poll(void)
 {
 	if (in_test_mode()) {
-		lcd_printfP(0, PSTR(" %d %d"), keymgr_state, current_key);
+		lcd_printfP(0, PSTR(" %d %d %u"), keymgr_state, current_key, ow_isr_cost());
 		lcd_printfP(1, PSTR("%d %d %d %d %d %d %d %d"), keys[0].state, keys[1].state, keys[2].state, keys[3].state, keys[4].state, keys[5].state, keys[6].state, keys[7].state);
 	}
 
@@ -178,6 +592,25 @@ void key_poll(void)
 		break;
 
 	case KMS_IDLE:
+		if (program_pending) {
+			program_pending = 0;
+			programming = 1;
+			program_step = PS_START;
+			current_key = program_slot;
+		} else if (fetch_head != fetch_tail) {
+			struct key_fetch_req *f = fetch_queue + (fetch_tail++ & (KEY_FETCH_QUEUE_SIZE - 1));
+
+			fetching = 1;
+			fetch_cb = f->cb;
+			current_key = f->slot;
+		} else if (!in_test_mode() && !key_next_due()) {
+			/* Nothing due, leave the bus alone */
+			break;
+		} else {
+			key_time_rotation();
+		}
+		keys[current_key].last_scan = global_qs_timer;
+		scan_settled = 1;
 		key_select();
 		keymgr_state = KMS_SELECT;
 		break;
@@ -206,8 +639,13 @@ void key_poll(void)
 			break;
 
 		if (!(PWR_PIN & PWR_BIT)) {
+			/* Whatever gets plugged in next starts over at the default speed and gets probed again */
+			key_clear_slot(keys + current_key);
+
 			if (programming)
-				program_cb(KS_EMPTY);
+				program_cb(KS_EMPTY, 0, 0);
+			else if (fetching)
+				key_fetch_done(KS_EMPTY);
 			else
 				set_key_state(KS_EMPTY);
 
@@ -215,6 +653,13 @@ void key_poll(void)
 			break;
 		}
 
+		/* The boot sweep only sorts out the empty slots, occupied ones get read once it is done */
+		if (boot_sweep && !programming && !fetching && !in_test_mode()) {
+			scan_settled = 0;
+			key_disable_and_next();
+			break;
+		}
+
 		key_power_on();
 		wait_ms = global_ms_timer;
 		keymgr_state = KMS_ENABLE;
@@ -224,20 +669,63 @@ void key_poll(void)
 		if (wait_done(2))
 			break;
 
-		if (programming)
-			eep_write(0, sizeof(key_xfer_data), &key_xfer_data, key_xfer_cb);
-		else
-			eep_read(0, sizeof(key_xfer_data), &key_xfer_data, key_xfer_cb);
-		keymgr_state = KMS_XFER;
+		xfer_speed = key_bus_speed();
+		ow_set_speed(xfer_speed);
+		ow_quality_reset();
+
+		/* Find out which part the key has once after it was plugged in */
+		if (keys[current_key].eep_type == EEP_TYPE_UNKNOWN) {
+			eep_detect(key_probe_cb);
+			keymgr_state = KMS_PROBE;
+			break;
+		}
+		eep_select(keys[current_key].eep_type);
+		/* fall through */
+
+	case KMS_PROBE_OK:
+		keys[current_key].eep_type = eep_type();
+
+		if (programming) {
+			key_program_next();
+		} else if (fetching) {
+			key_read(0, sizeof(key_xfer_data), &key_xfer_data);
+		} else if (keys[current_key].state == KS_VALID) {
+			/* The CRC covers the whole record, so reading just the CRC tells whether anything changed */
+			sig_read = 1;
+			key_read(offsetof(struct key_eeprom_data, crc16), sizeof(key_sig), &key_sig);
+		} else {
+			key_read(0, sizeof(key_xfer_data), &key_xfer_data);
+		}
+		break;
+
+	case KMS_PROGRAM:
+		/* The record read back has to carry the CRC that was written and match it */
+		if (program_step == PS_VERIFY && (!key_validate() || key_xfer_data.crc16 != program_data.crc16)) {
+			program_status = KS_CRC_ERROR;
+			ow_disconnect();
+			keymgr_state = KMS_XFER_OK;
+			break;
+		}
+		key_program_next();
 		break;
 
+	case KMS_PROBE:
 	case KMS_XFER:
 		/* State will be changed by callback */
 		break;
 
 	case KMS_XFER_ERR:
+		key_count_xfer(0);
+		sig_read = 0;
+		if (key_bus_speed_failed()) {
+			key_disable_and_next();
+			break;
+		}
+
 		if (programming)
-			program_cb(KS_READ_ERROR);
+			program_cb(KS_READ_ERROR, eep_pages_written(), eep_pages_skipped());
+		else if (fetching)
+			key_fetch_done(KS_READ_ERROR);
 		else
 			set_key_state(KS_READ_ERROR);
 
@@ -245,21 +733,51 @@ void key_poll(void)
 		break;
 
 	case KMS_XFER_OK:
+		key_count_xfer(1);
 		if (programming) {
-			program_cb(KS_VALID);
+			program_cb(program_status, eep_pages_written(), eep_pages_skipped());
 			key_disable_and_next();
 			break;
 		}
 
-		if (keys[current_key].state != KS_VALID || memcmp(&key_xfer_data, &keys[current_key].eep, sizeof(key_xfer_data))) {
-			if (!key_validate()) {
-				set_key_state(KS_CRC_ERROR);
-			} else {
-				memcpy(&keys[current_key].eep, &key_xfer_data, sizeof(key_xfer_data));
-				set_key_state(KS_VALID);
+		if (fetching) {
+			if (key_validate() && key_xfer_data.crc16 == keys[current_key].rec.crc16)
+				key_fetch_done(KS_VALID);
+			else
+				key_fetch_done(KS_CRC_ERROR);
+			key_disable_and_next();
+			break;
+		}
+
+		if (sig_read) {
+			sig_read = 0;
+			if (key_sig != keys[current_key].rec.crc16) {
+				/* Key changed, fetch the whole record */
+				key_read(0, sizeof(key_xfer_data), &key_xfer_data);
+				break;
+			}
+			set_key_state(KS_VALID);
+		} else if (!key_validate()) {
+			/* Garbage read at a speed not verified yet is more likely the bus than the key */
+			if (xfer_speed > keys[current_key].bus_speed && key_bus_speed_failed()) {
+				key_disable_and_next();
+				break;
 			}
+			set_key_state(KS_CRC_ERROR);
+		} else {
+			if (keys[current_key].state != KS_VALID || key_xfer_data.crc16 != keys[current_key].rec.crc16) {
+				/* Valid data with a different CRC is a different key */
+				if (keys[current_key].state == KS_VALID)
+					post_change(KS_VALID, KS_VALID);
+				key_set_record(&keys[current_key].rec, &key_xfer_data);
+			}
+			set_key_state(KS_VALID);
 		}
 
+		/* A speed only counts as verified if it worked without retries */
+		if (xfer_speed > keys[current_key].bus_speed && !eep_retries())
+			keys[current_key].bus_speed = xfer_speed;
+
 		key_disable_and_next();
 		break;
 
@@ -267,9 +785,12 @@ void key_poll(void)
 		if (wait_done(2))
 			break;
 
-		if (!in_test_mode())
-			current_key = (current_key >= MAX_KEYS - 1) ? 0 : (current_key + 1);
+		key_reschedule(keys + current_key);
+		if (current_key == MAX_KEYS - 1)
+			boot_sweep = 0;
 		idle();
 		break;
 	}
+
+	key_time_phase();
 }
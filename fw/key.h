@@ -27,6 +27,13 @@ struct key_eeprom_data {
 	uint16_t crc16;
 } __attribute__((packed));
 
+/* What a slot keeps of a valid record. Names are left on the key, see key_fetch(). */
+struct key_record {
+	uint8_t  key_id, kb_id;
+	uint8_t  dfl_timeout, max_timeout, flags;
+	uint16_t crc16;
+};
+
 enum key_state {
 	KS_UNKNOWN = 0,
 	KS_EMPTY,
@@ -35,18 +42,135 @@ enum key_state {
 	KS_VALID
 };
 
+/*
+ * Slots that keep reading the same get scanned less often, down to once per
+ * KEY_SCAN_MAX_INTERVAL quarter seconds. That is how long a removal may go unnoticed at most.
+ */
+#ifndef KEY_SCAN_MAX_INTERVAL
+#define KEY_SCAN_MAX_INTERVAL 4
+#endif
+
 struct key_socket {
 	uint8_t state, new_state, new_state_debounce;
-	struct key_eeprom_data eep;
+	uint8_t scan_interval;  /* Quarter seconds between scans, 0 for every round */
+	uint8_t last_scan;      /* global_qs_timer at the last scan */
+	uint8_t bus_speed;      /* Fastest bus speed verified with this key */
+	uint8_t bus_speed_fail; /* Slowest bus speed known to fail, 0 if none */
+	uint8_t eep_type;       /* Detected EEPROM part, see enum eep_type_e */
+	struct key_record rec;  /* Valid in KS_VALID */
 };
 
 extern struct key_socket keys[MAX_KEYS];
 
-typedef void (*key_program_cb)(uint8_t status);
+/*
+ * Slot state changes, queued for the UI along with an EV_KEY_CHANGE each.
+ * A slot whose valid record got replaced by a different valid one reports KS_VALID -> KS_VALID.
+ */
+struct key_change {
+	uint8_t slot, old_state, new_state;
+};
+
+enum key_change_e {
+	KC_NONE = 0,
+	KC_SLOT,    /* Change of a single slot */
+	KC_ALL,     /* Changes got lost or weren't tracked, look at all slots */
+};
+
+uint8_t key_get_change(struct key_change *c);
+
+enum key_op {
+	KOP_READ = 0,
+	KOP_WRITE,
+	KOP_NUM,
+};
+
+/* Bus statistics per slot, to spot worn jacks before they fail */
+struct key_op_stats {
+	uint16_t ok, err;
+	uint16_t retries;   /* Failures retried at a lower bus speed */
+	uint16_t glitches;  /* Failed transfers the EEPROM layer retried right away */
+	uint32_t bytes;
+	uint16_t fail_at[4]; /* Failures by position, see enum eep_fail_e */
+};
+
+struct key_bus_stats {
+	struct key_op_stats op[KOP_NUM];
+	uint32_t rx_bits;
+	uint16_t rx_marginal;
+};
+
+/* At 46 bytes per slot, only a single board can afford them in SRAM. Bigger ones sum them up over all slots. */
+#ifndef KEY_BUS_STATS_PER_SLOT
+#define KEY_BUS_STATS_PER_SLOT (MAX_KEYS <= 8)
+#endif
+#define KEY_BUS_STATS_SLOTS (KEY_BUS_STATS_PER_SLOT ? MAX_KEYS : 1)
+
+extern struct key_bus_stats key_stats[KEY_BUS_STATS_SLOTS];
+
+static inline struct key_bus_stats *key_slot_stats(uint8_t slot)
+{
+	return key_stats + (KEY_BUS_STATS_PER_SLOT ? slot : 0);
+}
+
+/* Phases of a slot scan, timed separately. Programming runs aren't timed. */
+enum key_phase {
+	KPH_SELECT = 0, /* Shift registers switching to the slot */
+	KPH_DETECT,     /* Waiting for the plug detection to settle */
+	KPH_ENABLE,     /* Waiting for the key power to settle */
+	KPH_XFER,       /* Probing and reading the EEPROM */
+	KPH_DISABLE,    /* Waiting for the key power to go down */
+	KPH_NUM,
+};
+
+struct key_time_stats {
+	uint16_t count;
+	uint16_t min, max;
+	uint32_t sum;
+};
+
+/* Scan timing since key_stats_reset() */
+struct key_scan_stats {
+	struct key_time_stats phase[KPH_NUM]; /* In get_fine_timer() ticks */
+	struct key_time_stats rotation;       /* Passes over all slots due, in get_ms_timer() ticks */
+	uint32_t elapsed;                     /* In get_ms_timer() ticks */
+};
+
+extern struct key_scan_stats key_scan_stats;
+
+/* Clear the scan timing and the bus statistics */
+void key_stats_reset(void);
+/* Bring key_scan_stats.elapsed up to date */
+void key_stats_update(void);
+
+/* Optional programming steps */
+enum key_program_flags {
+	KP_ERASE   = 1, /* Erase the whole part first */
+	KP_PROTECT = 2, /* Write protect the part when done */
+};
+
+/* Called with the resulting key state and how many EEPROM pages got written and were already up to date */
+typedef void (*key_program_cb)(uint8_t status, uint8_t pages_written, uint8_t pages_skipped);
 
 void key_init(void);
+/* Keep the slot states across the coming watchdog reset */
+void key_save_state(void);
 void key_poll(void);
-void key_program(uint8_t slot, struct key_eeprom_data *data, key_program_cb cb);
+/*
+ * Write the record, read it back to verify, optionally erasing and protecting the part around it.
+ * cb gets KS_VALID, or KS_EMPTY/KS_READ_ERROR/KS_CRC_ERROR (verify failed) when that went wrong.
+ */
+void key_program(uint8_t slot, struct key_eeprom_data *data, uint8_t flags, key_program_cb cb);
+
+/* data is only valid during the call, and only with KS_VALID */
+typedef void (*key_fetch_cb)(uint8_t slot, uint8_t status, const struct key_eeprom_data *data);
+
+/*
+ * Read the full record of a valid slot, e.g. for the names. cb gets KS_VALID with the record,
+ * KS_CRC_ERROR if the key doesn't hold the record the slot went by anymore, or KS_EMPTY/KS_READ_ERROR.
+ * Fetches run one after the other. Asking again before cb was called replaces the slot asked for.
+ * Returns 0 if too many callers are waiting already.
+ */
+uint8_t key_fetch(uint8_t slot, key_fetch_cb cb);
 
 void key_test_sel_slot(uint8_t slot);
 void key_test_start_scan(void);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <LUFA/Common/Common.h>
 #include "hw.h"
 #include "lcd_drv.h"
 #include "common.h"
@@ -10,11 +11,72 @@
 
 // the key-timers.
 int16_t keyTimers[MAX_KEYS + NUM_PIZZA_TIMERS];
-uint8_t keyMissing[MAX_KEYS] = { 0 };
+key_mask_t keyMissing = 0;
 
 /* Number of keys missing that need the rotating light */
 static uint8_t rotlight_counter = 0;
 
+/* ID of the key each keyMissing bit was set for, the config entries may change before a reset */
+static uint8_t missing_id[MAX_KEYS];
+
+/*
+ * Missing keys and timers survive watchdog resets, so a reset to apply config changes doesn't
+ * announce every key that was already gone again. Keys are kept by ID, their entries may have moved.
+ */
+struct timers_state {
+	struct {
+		uint8_t id;  /* 0 ends the list */
+		int16_t timer;
+	} missing[MAX_KEYS];
+	int16_t pizza[NUM_PIZZA_TIMERS];
+};
+
+static struct timers_state timers_state ATTR_NO_INIT;
+static uint16_t timers_crc ATTR_NO_INIT;
+
+static uint8_t check_expired_timers(void);
+
+void timers_save_state(void)
+{
+	uint8_t i, n = 0;
+
+	memset(&timers_state, 0, sizeof(timers_state));
+	for (i = 0; i < MAX_KEYS; i++) {
+		if (!isKeyMissing(i))
+			continue;
+		timers_state.missing[n].id = missing_id[i];
+		timers_state.missing[n++].timer = keyTimers[i];
+	}
+	memcpy(timers_state.pizza, keyTimers + MAX_KEYS, sizeof(timers_state.pizza));
+	timers_crc = warm_state_crc(&timers_state, sizeof(timers_state));
+}
+
+/* Take the missing keys back without announcing them, key_init() kept the slot states to match */
+static void restore_timers(void)
+{
+	uint8_t i;
+	int8_t config_idx;
+	struct key_info *k;
+
+	for (i = 0; i < MAX_KEYS && timers_state.missing[i].id; i++) {
+		config_idx = find_key(timers_state.missing[i].id);
+		if (config_idx < 0)
+			continue;
+		k = config.keys + config_idx;
+
+		keyMissing |= (key_mask_t)1 << config_idx;
+		missing_id[config_idx] = k->id;
+		if (k->flags & KF_BEEP)
+			keyTimers[config_idx] = timers_state.missing[i].timer;
+		if ((k->flags & KF_ROTLIGHT) && rotlight_counter++ == 0)
+			rotlight_on();
+	}
+	memcpy(keyTimers + MAX_KEYS, timers_state.pizza, sizeof(timers_state.pizza));
+
+	/* An alarm that was going off keeps going */
+	check_expired_timers();
+}
+
 void initTimers(void)
 {
 	uint8_t i;
@@ -22,6 +84,11 @@ void initTimers(void)
 	for (i = 0; i < ARRAY_SIZE(keyTimers); i++) {
 		keyTimers[i] = -1;
 	}
+
+	if (warm_start() && timers_crc == warm_state_crc(&timers_state, sizeof(timers_state)))
+		restore_timers();
+	/* Only good for the reset it was sealed for */
+	timers_crc = ~timers_crc;
 }
 
 static uint8_t check_expired_timers(void)
@@ -73,52 +140,74 @@ void key_timer(void)
 		check_expired_timers();
 }
 
-static uint8_t check_key_errors(void)
+/*
+ * Bookkeeping per slot, kept up to date from the slot changes key.c reports,
+ * so a change only costs a look at the slot and the config entries involved.
+ */
+static key_mask_t unknown_slots = KEY_MASK_ALL;  /* Not sure about these yet */
+static key_mask_t error_slots;
+static key_mask_t dirty_config;                  /* Config entries whose presence may have changed */
+static uint8_t slot_config[MAX_KEYS];            /* Config entry + 1 of the key in a slot, 0 if none */
+static uint8_t key_present[MAX_KEYS];            /* Slots holding each config entry's key */
+static uint8_t checks_held = 1;                  /* Missing keys weren't checked while unsure or in error */
+
+/* What is wrong with the key in a slot, 0 if it is either empty or one of ours */
+static uint8_t slot_error(uint8_t slot_idx)
 {
-	uint8_t config_idx, slot_idx;
-
-	for (slot_idx = 0; slot_idx < MAX_KEYS; slot_idx++) {
-		struct key_socket *k = keys + slot_idx;
-
-		// if the key is plugged, check if it's in our config.
-		if (k->state == KS_VALID) {
-			int keyBelongsToKeyboard = 0;
-
-			// If key belongs to a different keyboard, warn!
-			if (k->eep.kb.id != config.kb.id) {
-				ui_set_key_error(UIF_KEY_ERROR_OTHER_KB, slot_idx);
-				return 1;
-			}
-
-			for (config_idx = 0; config_idx < MAX_KEYS; config_idx++) {
-				if (k->eep.key.id == config.keys[config_idx].id) {
-					// this key is expected from our config.
-					keyBelongsToKeyboard = 1;
-					break;
-				}
-			}
-
-			// If key claims to belong to this keyboard, but is not known in the config -- warn!
-			if (keyBelongsToKeyboard == 0) {
-				ui_set_key_error(UIF_KEY_ERROR_UNKNOWN, slot_idx);
-				return 1;
-			}
-		} else if (k->state != KS_EMPTY) {
-			// there was some kind of error - we should do something about this... like annoy anyone close to the keyboard.
-			ui_set_key_error(UIF_KEY_ERROR_READ_ERR, slot_idx);
-			return 1;
-		}
-	}
+	struct key_socket *k = keys + slot_idx;
+
+	if (k->state == KS_EMPTY)
+		return 0;
+
+	// there was some kind of error - we should do something about this... like annoy anyone close to the keyboard.
+	if (k->state != KS_VALID)
+		return UIF_KEY_ERROR_READ_ERR;
+
+	// If key belongs to a different keyboard, warn!
+	if (k->rec.kb_id != config.kb.id)
+		return UIF_KEY_ERROR_OTHER_KB;
+
+	// If key claims to belong to this keyboard, but is not known in the config -- warn!
+	if (find_key(k->rec.key_id) < 0)
+		return UIF_KEY_ERROR_UNKNOWN;
 
-	ui_clear_key_error();
 	return 0;
 }
 
+static void slot_changed(uint8_t slot_idx)
+{
+	key_mask_t bit = (key_mask_t)1 << slot_idx;
+	uint8_t config_idx;
+
+	// Whatever key the slot held before is gone from it
+	if (slot_config[slot_idx]) {
+		config_idx = slot_config[slot_idx] - 1;
+		key_present[config_idx]--;
+		dirty_config |= (key_mask_t)1 << config_idx;
+		slot_config[slot_idx] = 0;
+	}
+
+	unknown_slots &= ~bit;
+	error_slots &= ~bit;
+
+	if (keys[slot_idx].state == KS_UNKNOWN) {
+		unknown_slots |= bit;
+	} else if (slot_error(slot_idx)) {
+		error_slots |= bit;
+	} else if (keys[slot_idx].state == KS_VALID) {
+		config_idx = find_key(keys[slot_idx].rec.key_id);
+		key_present[config_idx]++;
+		dirty_config |= (key_mask_t)1 << config_idx;
+		slot_config[slot_idx] = config_idx + 1;
+	}
+}
+
 static void setKeyMissing(uint8_t config_idx)
 {
 	struct key_info *k = config.keys + config_idx;
 
-	keyMissing[config_idx] = 1;
+	keyMissing |= (key_mask_t)1 << config_idx;
+	missing_id[config_idx] = k->id;
 	if (k->flags & KF_BEEP)
 		setKeyTimeout(config_idx, k->dfl_timeout);
 	if ((k->flags & KF_ROTLIGHT) && rotlight_counter++ == 0)
@@ -138,7 +227,7 @@ static void setKeyReturned(uint8_t config_idx)
 {
 	struct key_info *k = config.keys + config_idx;
 
-	keyMissing[config_idx] = 0;
+	keyMissing &= ~((key_mask_t)1 << config_idx);
 	if ((k->flags & KF_ROTLIGHT) && --rotlight_counter == 0)
 		rotlight_off();
 
@@ -151,28 +240,18 @@ static void setKeyReturned(uint8_t config_idx)
 
 static void check_missing_keys(void)
 {
-	uint8_t config_idx, slot_idx;
+	uint8_t config_idx;
 
-	for (config_idx = 0; config_idx < MAX_KEYS; config_idx++) {
+	/* Only up to the last entry that may have changed */
+	for (config_idx = 0; dirty_config; config_idx++, dirty_config >>= 1) {
 		// if the key is not plugged in, this keyboard?
-		if (config.keys[config_idx].id) {
-			uint8_t keyIsPresent = 0;
-
-			// this key should be available. check if it is.
-			for (slot_idx = 0; slot_idx < MAX_KEYS; slot_idx++) {
-				if (keys[slot_idx].state == KS_VALID
-						&& keys[slot_idx].eep.key.id == config.keys[config_idx].id
-						&& keys[slot_idx].eep.kb.id == config.kb.id) {
-					// key is present.
-					keyIsPresent = 1;
-					break;
-				}
-			}
+		if (config.keys[config_idx].id && (dirty_config & 1)) {
+			uint8_t keyIsPresent = (key_present[config_idx] != 0);
 
 			// if the key is not present, check if we need an alarm.
-			if (keyIsPresent == 0 && !keyMissing[config_idx])
+			if (keyIsPresent == 0 && !isKeyMissing(config_idx))
 				setKeyMissing(config_idx);
-			else if (keyIsPresent == 1 && keyMissing[config_idx])
+			else if (keyIsPresent == 1 && isKeyMissing(config_idx))
 				setKeyReturned(config_idx);
 		}
 	}
@@ -183,15 +262,37 @@ void key_change(void)
 	// current keyboard state: keys[]
 	// current keyboard configuration: config.keys[]
 
-	uint8_t slot_idx;
+	struct key_change c;
+	uint8_t slot_idx, kc;
+
+	while ((kc = key_get_change(&c)) != KC_NONE) {
+		if (kc == KC_SLOT) {
+			slot_changed(c.slot);
+			continue;
+		}
+		for (slot_idx = 0; slot_idx < MAX_KEYS; slot_idx++)
+			slot_changed(slot_idx);
+	}
 
 	// Check that we passed the initial phase where we're not sure about the state of our keys.
-	for (slot_idx = 0; slot_idx < MAX_KEYS; slot_idx++)
-		if (keys[slot_idx].state == KS_UNKNOWN)
-			return;
+	if (unknown_slots) {
+		checks_held = 1;
+		return;
+	}
 
-	if (check_key_errors())
+	if (error_slots) {
+		for (slot_idx = 0; !(error_slots & ((key_mask_t)1 << slot_idx)); slot_idx++)
+			;
+		ui_set_key_error(slot_error(slot_idx), slot_idx);
+		checks_held = 1;
 		return;
+	}
+	ui_clear_key_error();
 
+	// Catch up on everything that changed while the checks were held
+	if (checks_held) {
+		checks_held = 0;
+		dirty_config = KEY_MASK_ALL;
+	}
 	check_missing_keys();
 }
@@ -7,16 +7,18 @@
 #define KEY_TIMER_H_
 
 extern int16_t keyTimers[MAX_KEYS + NUM_PIZZA_TIMERS];
-extern uint8_t keyMissing[MAX_KEYS];
+extern key_mask_t keyMissing;  /* One bit per config entry */
 
 void initTimers(void);
+/* Keep missing keys and running timers across the coming watchdog reset */
+void timers_save_state(void);
 void key_change(void);
 void key_smaul(void);
 void key_timer(void);
 
 static inline uint8_t isKeyMissing(uint8_t key)
 {
-	return keyMissing[key];
+	return !!(keyMissing & ((key_mask_t)1 << key));
 }
 
 static inline void setKeyTimeout(uint8_t key, uint8_t minutes)
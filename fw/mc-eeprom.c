@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <avr/io.h>
+#include "common.h"
 #include "onewire.h"
 #include "mc-eeprom.h"
 
@@ -10,10 +11,14 @@ enum eep_state_e {
 	WR_ENABLE,
 	WR_WRITE,
 	WR_WAIT,
+	WR_STATUS,
 	PR_ENABLE,
 	ER_ENABLE,
 	ERPR_WRITE,
 	ERPR_WAIT,
+	ERPR_STATUS,
+	DETECT,
+	UPD_READ,
 };
 
 static volatile enum eep_state_e eep_state;
@@ -22,6 +27,19 @@ static uint16_t eep_remaining;
 static uint8_t *eep_buf;
 static eep_callback eep_cb;
 
+static uint8_t eep_chunk;        /* Size of the read or page write in flight */
+static uint8_t eep_retried;      /* Failed transfers retried in this operation */
+static uint8_t eep_attempt;      /* Retries of the transfer at hand */
+static uint8_t eep_answered;     /* Part answered within this operation */
+static uint8_t eep_backoff;      /* Waiting to retry a failed transfer */
+static uint8_t eep_addr_valid;   /* Part's address counter points to eep_addr */
+static uint8_t eep_updating;     /* Only write pages that differ */
+static uint8_t eep_written, eep_skipped;
+
+static uint8_t eep_twc;          /* Write cycle time to wait, grows if the part turns out slower */
+static uint8_t eep_cycle_start;  /* global_ms_timer at the end of the write command */
+static uint8_t eep_wait_start, eep_wait;
+
 enum eep_cmd_e {
 	CMD_READ  = 0x03,
 	CMD_CRRD  = 0x06,
@@ -42,19 +60,88 @@ enum eep_status_e {
 };
 
 #define EEP_READ_CHUNK 64
+/*
+ * A failed transfer is retried up to EEP_RETRIES times, after a pause that doubles each time,
+ * 1, 3 and 7 ms ticks.
+ * The longest is more than a write cycle, in case a write went through and only its SAK got lost.
+ */
+#define EEP_RETRIES 3
+
+/*
+ * Write cycle time of the 11AA parts (5ms max) in global_ms_timer ticks of 1.024ms.
+ * eep_waited() only counts whole ticks past the one the wait started in, so the bus stays
+ * quiet for more than 5.12ms before a single status read checks for completion.
+ */
+#define EEP_TWC_TICKS 5
+
+#define EEP_DEV_ADDR 0xA0
+
+/*
+ * All 11AA parts share the device address, the 16 byte write page and 16 bit addressing,
+ * so they can only be told apart by their size.
+ */
 #define EEP_WRITE_PAGE_SIZE 16
 
-static void eep_do_read(void)
+/* Until told otherwise, assume the largest part like before detection existed */
+static uint8_t eep_cur_type = EEP_11AA160;
+
+/* Detection probes and the pages eep_update() compares with go to eep_scratch, one page of any part */
+#define EEP_PROBE_SIZE 16
+static uint8_t eep_scratch[EEP_PROBE_SIZE];
+static uint16_t eep_probe_crc;
+static uint8_t eep_probe_type;
+
+static uint8_t eep_header[4];  /* device address, command, address/parameter */
+static uint8_t eep_header_size;
+static uint8_t eep_fail;
+static struct ow_seg eep_segs[2];
+static uint8_t eep_status;
+
+/* Send the header, followed by an optional payload straight from the caller's buffer */
+static void eep_xfer(uint8_t header_size, const uint8_t *payload, uint8_t payload_size,
+		uint16_t read_size, void *read_buf)
 {
-	uint8_t size = (eep_remaining > EEP_READ_CHUNK) ? EEP_READ_CHUNK : eep_remaining;
+	eep_header[0] = EEP_DEV_ADDR;
+	eep_header_size = header_size;
+	eep_segs[0].buf = eep_header;
+	eep_segs[0].size = header_size;
+	eep_segs[1].buf = payload;
+	eep_segs[1].size = payload_size;
+	ow_start(eep_segs, 2, read_size, read_buf);
+}
 
-	ow_buffer[0] = 0x55;
-	ow_buffer[1] = 0xA0;
-	ow_buffer[2] = CMD_READ;
-	ow_buffer[3] = eep_addr >> 8;
-	ow_buffer[4] = eep_addr & 0xFF;
-	ow_read_buf(5, size, eep_buf);
+/* Put eep_addr into the header after the command, returns the header size */
+static uint8_t eep_header_addr(void)
+{
+	eep_header[2] = eep_addr >> 8;
+	eep_header[3] = eep_addr & 0xFF;
+	return 4;
+}
+
+/*
+ * As long as the part's address counter is known to be in the right place, a current address
+ * read continues there without sending the address again. The counter is lost when the bus
+ * starts over with a standby pulse, i.e. after an error or ow_disconnect().
+ */
+static void eep_read_cmd(uint8_t size, void *buf)
+{
+	if (eep_addr_valid && !ow_error()) {
+		eep_header[1] = CMD_CRRD;
+		eep_xfer(2, 0, 0, size, buf);
+	} else {
+		eep_header[1] = CMD_READ;
+		eep_xfer(eep_header_addr(), 0, 0, size, buf);
+	}
+}
+
+static void eep_do_read(void)
+{
+	eep_chunk = (eep_remaining > EEP_READ_CHUNK) ? EEP_READ_CHUNK : eep_remaining;
+	eep_read_cmd(eep_chunk, eep_buf);
+}
 
+static void eep_read_advance(uint8_t size)
+{
 	eep_remaining -= size;
 	eep_addr += size;
 	eep_buf += size;
@@ -62,112 +149,332 @@ static void eep_do_read(void)
 
 static void eep_enable_write(void)
 {
-	ow_buffer[0] = 0x55;
-	ow_buffer[1] = 0xA0;
-	ow_buffer[2] = CMD_WREN;
-	ow_write(3);
+	eep_header[1] = CMD_WREN;
+	eep_xfer(2, 0, 0, 0, 0);
 }
 
 static void eep_read_status(void)
 {
-	ow_buffer[0] = 0x55;
-	ow_buffer[1] = 0xA0;
-	ow_buffer[2] = CMD_RDSR;
-	ow_read(3, 1);
+	eep_header[1] = CMD_RDSR;
+	eep_xfer(2, 0, 0, 1, &eep_status);
 }
 
-static void eep_do_write(void)
+static void eep_start_cycle(void)
+{
+	eep_cycle_start = eep_wait_start = global_ms_timer;
+	eep_wait = eep_twc;
+}
+
+static uint8_t eep_waited(void)
+{
+	uint8_t x = global_ms_timer - eep_wait_start;
+	return x > eep_wait;
+}
+
+/*
+ * Status read after the wait. If the part is still busy, check again on the next tick and
+ * wait at least as long on the remaining pages, so they get by with a single status read again.
+ */
+static uint8_t eep_cycle_done(void)
+{
+	if (!(eep_status & SR_WIP))
+		return 1;
+
+	eep_twc = global_ms_timer - eep_cycle_start;
+	eep_wait_start = global_ms_timer;
+	eep_wait = 0;
+	return 0;
+}
+
+/* Bytes from eep_addr to the end of its page or of the data, whichever comes first */
+static uint8_t eep_page_chunk(void)
 {
 	uint8_t page_left = EEP_WRITE_PAGE_SIZE - (eep_addr & (EEP_WRITE_PAGE_SIZE - 1));
-	uint8_t size = (eep_remaining > page_left) ? page_left : eep_remaining;
+	return (eep_remaining > page_left) ? page_left : eep_remaining;
+}
 
-	ow_buffer[0] = 0x55;
-	ow_buffer[1] = 0xA0;
-	ow_buffer[2] = CMD_WRITE;
-	ow_buffer[3] = eep_addr >> 8;
-	ow_buffer[4] = eep_addr & 0xFF;
-	memcpy(ow_buffer + 5, eep_buf, size);
-	ow_write(5 + size);
+static void eep_do_write(void)
+{
+	eep_chunk = eep_page_chunk();
 
-	eep_remaining -= size;
-	eep_addr += size;
-	eep_buf += size;
+	eep_header[1] = CMD_WRITE;
+	eep_xfer(eep_header_addr(), eep_buf, eep_chunk, 0, 0);
+
+	eep_remaining -= eep_chunk;
+	eep_addr += eep_chunk;
+	eep_buf += eep_chunk;
+	eep_written++;
+}
+
+/* Next page of an update, or the write enable for the next page of a plain write */
+static void eep_next_page(void)
+{
+	if (eep_updating) {
+		eep_chunk = eep_page_chunk();
+		eep_read_cmd(eep_chunk, eep_scratch);
+		eep_state = UPD_READ;
+	} else {
+		eep_enable_write();
+		eep_state = WR_ENABLE;
+	}
 }
 
 static void eep_set_protect(void)
 {
-	ow_buffer[0] = 0x55;
-	ow_buffer[1] = 0xA0;
-	ow_buffer[2] = CMD_WRSR;
-	ow_buffer[3] = eep_addr;
-	ow_write(4);
+	eep_header[1] = CMD_WRSR;
+	eep_header[2] = eep_addr;
+	eep_xfer(3, 0, 0, 0, 0);
 }
 
 static void eep_do_erase(void)
 {
-	ow_buffer[0] = 0x55;
-	ow_buffer[1] = 0xA0;
-	ow_buffer[2] = eep_addr;
-	ow_write(3);
+	eep_header[1] = eep_addr;
+	eep_xfer(2, 0, 0, 0, 0);
+}
+
+/* Read a probe block from eep_addr, its CRC ends up in ow_crc() */
+static void eep_do_probe(void)
+{
+	eep_header[1] = CMD_READ;
+	ow_crc_reset();
+	eep_xfer(eep_header_addr(), 0, 0, EEP_PROBE_SIZE, eep_scratch);
+}
+
+static void eep_detected(void)
+{
+	eep_select(eep_probe_type);
+	eep_state = IDLE;
+	eep_cb(1);
+}
+
+void eep_select(uint8_t type)
+{
+	eep_cur_type = type;
+}
+
+uint8_t eep_type(void)
+{
+	return eep_cur_type;
+}
+
+/* Every operation gets its own retry budget */
+static void eep_begin(eep_callback cb)
+{
+	eep_retried = 0;
+	eep_attempt = 0;
+	eep_answered = 0;
+	eep_cb = cb;
+}
+
+void eep_detect(eep_callback cb)
+{
+	eep_begin(cb);
+	eep_addr_valid = 0;
+	/* Smaller parts ignore the upper address bits, so probes past their end wrap around */
+	eep_probe_type = 0;
+	eep_addr = 0;
+	eep_state = DETECT;
+	eep_do_probe();
 }
 
 void eep_read(uint16_t addr, uint16_t size, void *buf, eep_callback cb)
 {
+	eep_begin(cb);
 	eep_addr = addr;
 	eep_remaining = size;
 	eep_buf = buf;
-	eep_cb = cb;
 	eep_state = READ;
+	eep_addr_valid = 0;
+	ow_crc_reset();
 	eep_do_read();
 }
 
-void eep_write(uint16_t addr, uint16_t size, void *buf, eep_callback cb)
+void eep_read_next(uint16_t size, void *buf, eep_callback cb)
 {
+	eep_begin(cb);
+	eep_remaining = size;
+	eep_buf = buf;
+	eep_state = READ;
+	eep_do_read();
+}
+
+static void eep_start_write(uint16_t addr, uint16_t size, void *buf, eep_callback cb)
+{
+	eep_begin(cb);
 	eep_addr = addr;
 	eep_remaining = size;
 	eep_buf = buf;
-	eep_cb = cb;
-	eep_state = WR_ENABLE;
-	eep_enable_write();
+	eep_addr_valid = 0;
+	eep_twc = EEP_TWC_TICKS;
+	eep_written = 0;
+	eep_skipped = 0;
+	eep_next_page();
+}
+
+void eep_write(uint16_t addr, uint16_t size, void *buf, eep_callback cb)
+{
+	eep_updating = 0;
+	eep_start_write(addr, size, buf, cb);
+}
+
+void eep_update(uint16_t addr, uint16_t size, void *buf, eep_callback cb)
+{
+	eep_updating = 1;
+	eep_start_write(addr, size, buf, cb);
+}
+
+uint8_t eep_pages_written(void)
+{
+	return eep_written;
+}
+
+uint8_t eep_pages_skipped(void)
+{
+	return eep_skipped;
 }
 
 void eep_protect(uint8_t protbits, eep_callback cb)
 {
+	eep_begin(cb);
 	eep_state = PR_ENABLE;
 	eep_addr = protbits;
-	eep_cb = cb;
+	eep_addr_valid = 0;
+	eep_twc = EEP_TWC_TICKS;
 	eep_enable_write();
 }
 
 void eep_erase(uint8_t erase_value, eep_callback cb)
 {
+	eep_begin(cb);
 	eep_state = ER_ENABLE;
 	eep_addr = erase_value;
-	eep_cb = cb;
+	eep_addr_valid = 0;
+	eep_twc = EEP_TWC_TICKS;
 	eep_enable_write();
 }
 
+uint8_t eep_fail_pos(void)
+{
+	return eep_fail;
+}
+
+uint8_t eep_retries(void)
+{
+	return eep_retried;
+}
+
 void eep_abort(void)
 {
 	eep_state = IDLE;
+	eep_backoff = 0;
+	eep_addr_valid = 0;
+	eep_written = 0;
+	eep_skipped = 0;
 	ow_disconnect();
 }
 
+/* Start the transfer that failed over again, the part is back at standby */
+static void eep_redo(void)
+{
+	switch (eep_state) {
+	case READ:
+		eep_do_read();
+		break;
+	case WR_WRITE:
+		/* The part drops a write that didn't end properly, send the page again */
+		eep_remaining += eep_chunk;
+		eep_addr -= eep_chunk;
+		eep_buf -= eep_chunk;
+		eep_written--;
+		/* fall through */
+	case WR_ENABLE:
+		eep_enable_write();
+		eep_state = WR_ENABLE;
+		break;
+	case ERPR_WRITE:
+		eep_enable_write();
+		eep_state = (eep_header[1] == CMD_WRSR) ? PR_ENABLE : ER_ENABLE;
+		break;
+	case PR_ENABLE:
+	case ER_ENABLE:
+		eep_enable_write();
+		break;
+	case WR_STATUS:
+	case ERPR_STATUS:
+		eep_read_status();
+		break;
+	case UPD_READ:
+		eep_read_cmd(eep_chunk, eep_scratch);
+		break;
+	case DETECT:
+		eep_do_probe();
+		break;
+	default:
+		break;
+	}
+}
+
 void eep_poll(void)
 {
 	enum eep_state_e eep_state_copy = eep_state;
 
-	if (eep_state_copy == IDLE || !ow_done())
+	if (eep_state_copy == IDLE)
+		return;
+	if (eep_backoff) {
+		if (eep_waited()) {
+			eep_backoff = 0;
+			eep_redo();
+		}
+		return;
+	}
+
+	if (!ow_done())
 		return;
 
 	if (ow_error()) {
+		uint16_t pos = ow_byte_pos();
+
+		if (pos <= 1)
+			eep_fail = EEP_FAIL_DEV;
+		else if (pos == 2)
+			eep_fail = EEP_FAIL_CMD;
+		else if (pos <= eep_header_size)
+			eep_fail = EEP_FAIL_ADDR;
+		else
+			eep_fail = EEP_FAIL_DATA;
+
+		/* Resume a read right after the last byte that made it, a read making progress isn't stuck */
+		if (eep_state_copy == READ && pos > eep_header_size + 1) {
+			eep_read_advance(pos - eep_header_size - 1);
+			eep_attempt = 0;
+		}
+
+		/*
+		 * No answer to the device address from a part that hasn't answered yet most likely means
+		 * there is none, that gets one more try only. Anything else is taken as a glitch.
+		 */
+		if (eep_attempt < ((eep_fail != EEP_FAIL_DEV || eep_answered) ? EEP_RETRIES : 1)) {
+			eep_addr_valid = 0;
+			eep_wait_start = global_ms_timer;
+			eep_wait = (2 << eep_attempt) - 1;
+			eep_attempt++;
+			eep_retried++;
+			eep_backoff = 1;
+			return;
+		}
+
 		eep_state = IDLE;
 		eep_cb(0);
 		return;
 	}
 
+	eep_answered = 1;
+	eep_attempt = 0;
+
 	switch (eep_state_copy) {
 	case READ:
+		eep_read_advance(eep_chunk);
+		eep_addr_valid = 1;
 		if (eep_remaining) {
 			eep_do_read();
 		} else {
@@ -180,15 +487,20 @@ void eep_poll(void)
 		eep_state = WR_WRITE;
 		break;
 	case WR_WRITE:
-		eep_read_status();
+		eep_start_cycle();
 		eep_state = WR_WAIT;
 		break;
 	case WR_WAIT:
-		if (ow_buffer[3] & SR_WIP) {
+		if (eep_waited()) {
 			eep_read_status();
+			eep_state = WR_STATUS;
+		}
+		break;
+	case WR_STATUS:
+		if (!eep_cycle_done()) {
+			eep_state = WR_WAIT;
 		} else if (eep_remaining) {
-			eep_enable_write();
-			eep_state = WR_ENABLE;
+			eep_next_page();
 		} else {
 			eep_state = IDLE;
 			eep_cb(1);
@@ -203,12 +515,60 @@ void eep_poll(void)
 		eep_state = ERPR_WRITE;
 		break;
 	case ERPR_WRITE:
-		eep_read_status();
+		eep_start_cycle();
 		eep_state = ERPR_WAIT;
 		break;
 	case ERPR_WAIT:
-		if (ow_buffer[3] & SR_WIP) {
+		if (eep_waited()) {
 			eep_read_status();
+			eep_state = ERPR_STATUS;
+		}
+		break;
+	case ERPR_STATUS:
+		if (!eep_cycle_done()) {
+			eep_state = ERPR_WAIT;
+		} else {
+			eep_state = IDLE;
+			eep_cb(1);
+		}
+		break;
+	case DETECT:
+		/*
+		 * Smaller parts wrap around, so the block at the start of the array shows up again at
+		 * the part's size. The first size where it does is taken as the part's size.
+		 * A blank part looks the same everywhere and comes out as the smallest part.
+		 */
+		if (!eep_addr) {
+			eep_probe_crc = ow_crc();
+		} else if (ow_crc() == eep_probe_crc) {
+			eep_detected();
+			break;
+		} else {
+			eep_probe_type++;
+		}
+
+		if (eep_probe_type == EEP_NUM_TYPES - 1) {
+			eep_detected();
+			break;
+		}
+
+		eep_addr = eep_size(eep_probe_type);
+		eep_do_probe();
+		break;
+	case UPD_READ:
+		if (memcmp(eep_scratch, eep_buf, eep_chunk)) {
+			/* The page gets written at eep_addr, which leaves the part's address counter elsewhere */
+			eep_addr_valid = 0;
+			eep_enable_write();
+			eep_state = WR_ENABLE;
+			break;
+		}
+
+		eep_read_advance(eep_chunk);
+		eep_addr_valid = 1;
+		eep_skipped++;
+		if (eep_remaining) {
+			eep_next_page();
 		} else {
 			eep_state = IDLE;
 			eep_cb(1);
@@ -15,8 +15,50 @@ enum eep_erase_e {
 	EEP_ERASE_FF = 0x67,
 };
 
+enum eep_type_e {
+	EEP_11AA010 = 0,
+	EEP_11AA020,
+	EEP_11AA040,
+	EEP_11AA080,
+	EEP_11AA160,   /* and 11AA161 */
+	EEP_NUM_TYPES,
+	EEP_TYPE_UNKNOWN = 0xFF,
+};
+
+static inline uint16_t eep_size(uint8_t type)
+{
+	return 128 << type;
+}
+
+/* Part of the transfer a failed operation broke down in */
+enum eep_fail_e {
+	EEP_FAIL_DEV = 0,  /* Device address, i.e. no key answering at all */
+	EEP_FAIL_CMD,
+	EEP_FAIL_ADDR,     /* Address or other command parameter */
+	EEP_FAIL_DATA,
+	EEP_FAIL_NUM,
+};
+
+/**
+ * Read size bytes from addr into buf. ow_crc() holds the CRC16 of the data read when done.
+ */
 void eep_read(uint16_t addr, uint16_t size, void *buf, eep_callback cb);
+/**
+ * Continue reading where the last read left off, ow_crc() keeps accumulating.
+ * Uses current address reads as long as the key stayed powered and the bus had no error.
+ */
+void eep_read_next(uint16_t size, void *buf, eep_callback cb);
+
 void eep_write(uint16_t addr, uint16_t size, void *buf, eep_callback cb);
+/**
+ * Like eep_write(), but read each page first and only write the pages that differ
+ */
+void eep_update(uint16_t addr, uint16_t size, void *buf, eep_callback cb);
+/**
+ * Pages the last eep_write()/eep_update() wrote and left alone because they already matched
+ */
+uint8_t eep_pages_written(void);
+uint8_t eep_pages_skipped(void);
 void eep_erase(uint8_t erase_value, eep_callback cb);
 void eep_protect(uint8_t protbits, eep_callback cb);
 
@@ -25,6 +67,27 @@ void eep_protect(uint8_t protbits, eep_callback cb);
  */
 void eep_abort(void);
 
+/**
+ * Where the last failed operation broke down, one of enum eep_fail_e
+ */
+uint8_t eep_fail_pos(void);
+/**
+ * Failed transfers the last operation retried. Only failures that persist through the
+ * retries, or where no part answers at all, fail the operation.
+ */
+uint8_t eep_retries(void);
+
+/**
+ * Find out which part is on the bus. On success, it is selected and eep_type() returns it.
+ */
+void eep_detect(eep_callback cb);
+
+/**
+ * Select the part subsequent operations go to, eep_type() returns it
+ */
+void eep_select(uint8_t type);
+uint8_t eep_type(void);
+
 void eep_poll(void);
 
 #endif /* MC_EEPROM_H_ */
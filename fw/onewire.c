@@ -1,14 +1,24 @@
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
-#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include "onewire.h"
 
-uint8_t ow_buffer[OW_MAX_XFER];
 volatile enum ow_state_e ow_state;
+volatile uint16_t ow_isr_count;
+static uint16_t isr_count;             /* Interrupts so far on the current transfer, ISRs only */
+uint16_t ow_rx_crc;
+uint16_t ow_rx_bits, ow_rx_marginal;
 
-static uint8_t phase, step, shiftreg, next_bit;
-static uint8_t ow_ptr, ow_read_pos, ow_last_pos;
+static uint8_t shiftreg;
+static uint8_t ow_sync;                /* Current byte is the sync byte */
+static uint16_t ow_remaining;          /* Bytes to go after the current one */
+static uint16_t ow_total;
+static uint16_t ow_read_size;          /* The last ow_read_size bytes are received */
 static uint8_t *ow_read_buf;
+static const struct ow_seg *ow_seg;    /* Next segment to send from */
+static const uint8_t *ow_tx_ptr;
+static uint8_t ow_tx_left;             /* Bytes left in the current segment */
 
 #define SCIO_PORT PORTD
 #define SCIO_PIN  PIND
@@ -38,11 +48,136 @@ static inline void set_txrx(int tx)
 	}
 }
 
+/* Timer 0 only runs during transfers, so an idle bus costs no interrupts */
+static inline void ow_timer_run(void)
+{
+	TCCR0B = 2 << CS00;  /* prescaler divide by 8 -> 0.5us per tick */
+}
+
+static inline void ow_stop(enum ow_state_e state)
+{
+	TCCR0B = 0;
+	ow_isr_count = isr_count;
+	ow_state = state;
+}
+
+/* MAK bit to send after the current byte: 1 if more bytes follow */
+static inline uint8_t ow_mak(void)
+{
+	return ow_remaining != 0;
+}
+
+/*
+ * Byte level bookkeeping shared by both bus engines, called once the SAK of the current byte is known.
+ * Stores the received byte from shiftreg and adds it to the running CRC, loads the next byte
+ * to send from the segment list into shiftreg and returns the new bus state.
+ */
+static inline enum ow_state_e ow_next_byte(uint8_t sak)
+{
+	if (!sak && !ow_sync) /* NoSAK on anything other than the sync byte */
+		return OW_ERROR;
+	ow_sync = 0;
+
+	if (ow_remaining < ow_read_size) {
+		*(ow_read_buf++) = shiftreg;
+		ow_rx_crc = _crc16_update(ow_rx_crc, shiftreg);
+	}
+
+	if (!ow_remaining) {
+		set_txrx(1);
+		set_tx_pin(1);
+		return OW_IDLE;
+	}
+
+	if (--ow_remaining < ow_read_size)
+		return OW_RX;
+
+	while (!ow_tx_left) {
+		ow_tx_ptr = ow_seg->buf;
+		ow_tx_left = ow_seg->size;
+		ow_seg++;
+	}
+	ow_tx_left--;
+	shiftreg = *(ow_tx_ptr++);
+	return OW_TX;
+}
+
+/*
+ * Standby pulse and start header, in timer ticks (0.5us).
+ * The standby pulse is longer than the timer can count, so it is split up into several waits.
+ */
+#define T_STANDBY_LOW  10   /* 5us low, datasheet requires a 0->1 transition after POR/BOR */
+#define T_STANDBY      250  /* N_STANDBY * 125us high, datasheet table 1-2 says Tstby > 600us */
+#define N_STANDBY      5
+#define T_SS           30   /* Datasheet table 1-2 says Tss > 10us */
+#define T_HDR          14   /* Datasheet table 1-2 says Thdr > 5us */
+
+static uint8_t seq;
+
+static void ow_timer_start(uint8_t ticks);
+static void ow_timer_wait(uint8_t ticks);
+static void ow_start_engine(void);
+
+/* Next step of standby pulse and start header, called from the timer interrupt */
+static void ow_seq_step(void)
+{
+	uint8_t s = seq++;
+
+	if (s == 0) {
+		set_tx_pin(1);
+		ow_timer_wait(T_STANDBY);
+	} else if (s < N_STANDBY) {
+		ow_timer_wait(T_STANDBY);
+	} else if (s == N_STANDBY) {
+		ow_state = OW_HEADER;
+		ow_timer_wait(T_SS);
+	} else if (s == N_STANDBY + 1) {
+		set_tx_pin(0);
+		ow_timer_wait(T_HDR);
+	} else {
+		ow_start_engine();
+	}
+}
+
+#if !OW_EDGE_ENGINE
+
+static uint8_t phase, step, next_bit;
+
+/*
+ * Decode the bit from its phase 1 (next_bit) and phase 3 samples, a valid bit has a transition in between.
+ * The sync byte's SAK slot stays empty, so it doesn't count.
+ */
+static inline uint8_t rx_sample(uint8_t pin)
+{
+	if (!ow_sync) {
+		ow_rx_bits++;
+		if (pin == next_bit)
+			ow_rx_marginal++;
+	}
+	return pin && !next_bit;
+}
+static uint8_t wait_left;
+
+/* Timer ticks per quarter bit for each speed */
+static const PROGMEM uint8_t quarter_bit_ticks[OW_NUM_SPEEDS] = { 25, 17, 13 };
+
 ISR(TIMER0_COMPA_vect)
 {
 	/* Get a stable local copy of the volatile control variable */
 	enum ow_state_e local_state = ow_state;
 
+	isr_count++;
+
+	if (local_state < OW_TX) { /* STANDBY or HEADER */
+		uint8_t q = OCR0A + 1;
+
+		if (wait_left > q)
+			wait_left -= q;
+		else
+			ow_seq_step();
+		return;
+	}
+
 	/* First of all, do the actual bit TX/RX to minimize jitter */
 	if (local_state == OW_TX) {
 		if (phase == 0) {
@@ -57,7 +192,7 @@ ISR(TIMER0_COMPA_vect)
 		else if (phase == 1)
 			next_bit = get_rx_pin();
 		else if (phase == 3)
-			next_bit = get_rx_pin() && !next_bit;
+			next_bit = rx_sample(get_rx_pin());
 	} else { /* IDLE or ERROR */
 		return;
 	}
@@ -76,34 +211,21 @@ ISR(TIMER0_COMPA_vect)
 		} else if (step == 8) {
 			if (local_state == OW_RX)
 				shiftreg |= next_bit;
-			next_bit = !(ow_ptr == ow_last_pos);
+			next_bit = ow_mak();
 			ow_state = OW_TX;
 		} else if (step == 9) {
 			ow_state = OW_RX;
 		} else {
-			if (!next_bit && ow_ptr) { /* NoSAK on anything other than the sync byte */
-				ow_state = OW_ERROR;
+			local_state = ow_next_byte(next_bit);
+			if (local_state >= OW_IDLE) {
+				ow_stop(local_state);
 				return;
 			}
+			ow_state = local_state;
 
 			step = 0;
-
-			if (ow_ptr >= ow_read_pos)
-				*(ow_read_buf++) = shiftreg;
-
-			ow_ptr++;
-
-			if (ow_ptr > ow_last_pos) {
-				set_txrx(1);
-				set_tx_pin(1);
-				ow_state = OW_IDLE;
-			} else if (ow_ptr >= ow_read_pos) {
-				ow_state = OW_RX;
-			} else {
-				ow_state = OW_TX;
-				shiftreg = ow_buffer[ow_ptr];
+			if (local_state == OW_TX)
 				next_bit = !!(shiftreg & 0x80);
-			}
 			shiftreg <<= 1;
 		}
 	}
@@ -114,64 +236,318 @@ void ow_init(void)
 	ow_disconnect(); /* Force sane state */
 
 	/*
-	 * Set up Timer 0 to run at F_CPU / 8 (0.5us per tick).
-	 * Overflow after 25 ticks -> Interrupt every 12.5us -> 50us bit period -> 20kHz bus frequency
+	 * Set up Timer 0 to run at F_CPU / 8 (0.5us per tick) once ow_start() starts it.
+	 * At the default speed, overflow after 25 ticks -> Interrupt every 12.5us -> 50us bit period -> 20kHz bus frequency
 	 */
-	OCR0A  = 24;
+	ow_set_speed(OW_SPEED_DEFAULT);
 	TCNT0  = 0;
 	TIMSK0 = 1 << OCIE0A;
 	TIFR0  = 1 << OCF0A;
 	TCCR0A = 2 << WGM00; /* CTC mode */
-	TCCR0B = 2 << CS00;  /* prescaler divide by 8 & start timer */
 }
 
-void ow_reset(void)
+void ow_set_speed(uint8_t speed)
 {
-	set_txrx(1);
-	set_tx_pin(0);   /* Datasheet requires a 0->1 transition after POR/BOR; make sure there is one */
-	_delay_us(5);    /* Give the line time to go low */
-	set_tx_pin(1);
-	_delay_us(600);  /* Datashet table 1-2 says Tstby > 600us */
-	ow_state = OW_IDLE;
+	OCR0A = pgm_read_byte(quarter_bit_ticks + speed) - 1;
 }
 
-void ow_start(uint8_t write_size, uint8_t read_size, void *read_buf)
+/* Timer is stopped here, so the first interrupt comes exactly one quarter bit after ow_timer_run() */
+static void ow_timer_start(uint8_t ticks)
 {
-	if (ow_state == OW_ERROR)
-		ow_reset();
+	TCNT0 = 0;
+	TIFR0 = 1 << OCF0A;
+	wait_left = ticks;
+}
 
+/* The timer keeps interrupting every quarter bit, count the wait down from there */
+static void ow_timer_wait(uint8_t ticks)
+{
+	wait_left = ticks;
+}
+
+static void ow_start_engine(void)
+{
 	phase = 0;
 	step = 0;
-	ow_ptr = 0;
-	ow_last_pos = write_size + read_size - 1;
-	ow_read_pos = read_size ? write_size : 0xFF;
-	ow_read_buf = read_buf ?: ow_buffer + write_size;
 	shiftreg = 0x55 << 1;
 	next_bit = 0;
 
-	/* send start sequence */
-	set_txrx(1);
-	set_tx_pin(1);
-	_delay_us(15);  /* Datasheet table 1-2 says Tss > 10us */
-	set_tx_pin(0);
-	_delay_us(7);	/* Datasheet table 1-2 says Thdr > 5us */
+	/* Sync byte starts with the next interrupt */
+	ow_state = OW_TX;
+}
+
+#else /* OW_EDGE_ENGINE */
+
+/*
+ * Edge driven engine.
+ *
+ * Timer0 runs freely in normal mode and serves as the time base. On TX, the compare interrupt
+ * is scheduled for the next point in time where the line level actually changes, so a bit costs
+ * one or two interrupts instead of four. On RX, INT1 fires on every edge of SCIO. Edges closer
+ * than 1.5 half bits to the previous mid-bit edge are bit boundaries and get ignored, everything
+ * else is a mid-bit edge whose direction is the bit value. The compare interrupt acts as timeout
+ * while receiving, so a missing edge (e.g. NoSAK) ends the transfer with an error.
+ */
+
+/* Timer ticks per half bit for each speed, 50 ticks = 25us at F_CPU / 8 -> 50us bit period -> 20kHz */
+static const PROGMEM uint8_t half_bit_ticks[OW_NUM_SPEEDS] = { 50, 33, 25, 20 };
+
+static uint8_t half, half_1_5, half_3;
+static uint8_t bit_lo, bit_hi;     /* Mid-bit edge distances outside these are marginal */
+static uint8_t ref;                /* Timestamp of the last mid-bit edge */
+static uint8_t tx_half, rx_bits;
+static uint16_t tx_bits;           /* Byte to send, followed by MAK */
+
+/*
+ * Line level during half bit h of the byte currently being sent.
+ * Manchester: 0 is sent as high->low, 1 as low->high.
+ */
+static inline uint8_t tx_level(uint8_t h)
+{
+	uint8_t bit = (tx_bits >> (8 - (h >> 1))) & 1;
+	return (h & 1) ? bit : !bit;
+}
+
+static inline void rx_enable(uint8_t enable)
+{
+	if (enable) {
+		EIFR  = 1 << INTF1; /* Our own TX edges have set the flag */
+		EIMSK |= 1 << INT1;
+	} else {
+		EIMSK &= ~(1 << INT1);
+	}
+}
+
+/* Set up the next byte after the SAK, timing relative to the SAK's mid-bit edge in ref */
+static void edge_next_byte(uint8_t sak)
+{
+	enum ow_state_e local_state = ow_next_byte(sak);
+
+	if (local_state == OW_RX) {
+		rx_bits = 0;
+		OCR0A = ref + half_3;
+	} else if (local_state == OW_ERROR) {
+		rx_enable(0);
+		ow_stop(OW_ERROR);
+		return;
+	} else {
+		rx_enable(0);
+		OCR0A = ref + half;
+		if (local_state == OW_TX) {
+			tx_bits = (shiftreg << 1) | ow_mak();
+			tx_half = 0;
+		} else {
+			/* Only report completion at the end of the SAK bit, the next start header is timed from there */
+			local_state = OW_TX;
+			tx_half = 20;
+		}
+	}
+	ow_state = local_state;
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+	enum ow_state_e local_state = ow_state;
+
+	isr_count++;
+
+	if (local_state < OW_TX) { /* STANDBY or HEADER */
+		ow_seq_step();
+
+		/* Sync byte starts right at the end of the header */
+		local_state = ow_state;
+		if (local_state != OW_TX)
+			return;
+	}
+
+	if (local_state == OW_TX) {
+		uint8_t h = tx_half;
+
+		if (h < 18) {
+			set_txrx(1);
+			set_tx_pin(tx_level(h));
+
+			/* Skip half bits that don't change the line level */
+			do
+				h++;
+			while (h < 18 && tx_level(h) == tx_level(h - 1));
+
+			OCR0A += (h - tx_half == 1) ? half : (half << 1);
+			tx_half = h;
+		} else if (h == 18) {
+			/* MAK sent, release the line for the SAK */
+			set_txrx(0);
+			ref = OCR0A - half;
+
+			if (ow_sync) {
+				/* The slave doesn't answer the sync byte, just let the SAK slot pass */
+				ref += half << 1;
+				edge_next_byte(1);
+			} else {
+				/*
+				 * This interrupt runs right at the SAK's leading bit boundary. Only start
+				 * listening half way to its mid-bit edge, otherwise the boundary edge may
+				 * get timestamped late enough to pass as a mid-bit edge at higher speeds.
+				 */
+				tx_half = 19;
+				OCR0A += half >> 1;
+			}
+		} else if (h == 19) {
+			ow_state = OW_RX;
+			rx_bits = 8;
+			rx_enable(1);
+			OCR0A = ref + half_3;
+		} else {
+			ow_stop(OW_IDLE);
+		}
+	} else if (local_state == OW_RX) {
+		/* No mid-bit edge in time */
+		rx_enable(0);
+		ow_stop(OW_ERROR);
+	}
+}
+
+ISR(INT1_vect)
+{
+	uint8_t now = TCNT0;
+	uint8_t bit = get_rx_pin();
+
+	isr_count++;
+
+	if ((uint8_t)(now - ref) < half_1_5)
+		return; /* bit boundary */
 
-	/* Set off timer function */
+	ow_rx_bits++;
+	if ((uint8_t)(now - ref) < bit_lo || (uint8_t)(now - ref) > bit_hi)
+		ow_rx_marginal++;
+	ref = now;
+	OCR0A = now + half_3;
+
+	if (rx_bits < 8) {
+		shiftreg = (shiftreg << 1) | bit;
+		if (++rx_bits == 8) {
+			/* Take over the line for the MAK */
+			rx_enable(0);
+			tx_bits = ow_mak();
+			tx_half = 16;
+			OCR0A = now + half;
+			ow_state = OW_TX;
+		}
+	} else {
+		edge_next_byte(bit);
+	}
+}
+
+void ow_init(void)
+{
+	ow_disconnect(); /* Force sane state */
+	ow_set_speed(OW_SPEED_DEFAULT);
+
+	/* INT1 on any edge of SCIO, only enabled while receiving */
+	EICRA  = (EICRA & ~(3 << ISC10)) | (1 << ISC10);
+
+	/* Timer 0 runs freely at F_CPU / 8 (0.5us per tick) during transfers, compare match schedules the bus events */
+	TCNT0  = 0;
+	TIMSK0 = 1 << OCIE0A;
+	TIFR0  = 1 << OCF0A;
+	TCCR0A = 0;          /* normal mode */
+}
+
+void ow_set_speed(uint8_t speed)
+{
+	half     = pgm_read_byte(half_bit_ticks + speed);
+	half_1_5 = half + (half >> 1);
+	half_3   = 3 * half;
+	bit_lo   = 2 * half - (half >> 2);
+	bit_hi   = 2 * half + (half >> 2);
+}
+
+static void ow_timer_start(uint8_t ticks)
+{
+	OCR0A = TCNT0 + ticks;
+	TIFR0 = 1 << OCF0A;
+}
+
+static void ow_timer_wait(uint8_t ticks)
+{
+	OCR0A += ticks;
+}
+
+static void ow_start_engine(void)
+{
+	shiftreg = 0x55;
+	tx_bits = (shiftreg << 1) | ow_mak();
+	tx_half = 0;
 	ow_state = OW_TX;
 }
 
+#endif /* OW_EDGE_ENGINE */
+
+void ow_start(const struct ow_seg *segs, uint8_t num_segs, uint16_t read_size, void *read_buf)
+{
+	ow_sync = 1;
+	ow_seg = segs;
+	ow_tx_left = 0;
+	ow_read_size = read_size;
+	ow_read_buf = read_buf;
+
+	ow_remaining = read_size;
+	while (num_segs--)
+		ow_remaining += (segs++)->size;
+	ow_total = ow_remaining;
+
+	/*
+	 * The timer interrupt takes it from here: after an error, a standby pulse resets the slave,
+	 * then the start header is sent followed by the transfer itself.
+	 */
+	set_txrx(1);
+	if (ow_state == OW_ERROR) {
+		set_tx_pin(0);
+		seq = 0;
+		ow_timer_start(T_STANDBY_LOW);
+		ow_state = OW_STANDBY;
+	} else {
+		set_tx_pin(1);
+		seq = N_STANDBY + 1;
+		ow_timer_start(T_SS);
+		ow_state = OW_HEADER;
+	}
+
+	isr_count = 0;
+	ow_timer_run();
+}
+
+uint16_t ow_isr_cost(void)
+{
+	uint8_t sreg = SREG;
+	uint16_t count;
+
+	cli();
+	count = ow_isr_count;
+	SREG = sreg;
+	return count;
+}
+
+uint16_t ow_byte_pos(void)
+{
+	return ow_total - ow_remaining;
+}
+
 void ow_disconnect(void)
 {
+#if OW_EDGE_ENGINE
+	EIMSK &= ~(1 << INT1);
+#endif
 	set_txrx(1);
 	set_tx_pin(0);
-	ow_state = OW_ERROR;  /* Make sure the first transmission starts with a reset */
+	ow_stop(OW_ERROR);  /* Make sure the first transmission starts with a reset */
 }
 
 uint8_t ow_wait(void)
 {
 	sleep_enable();
-	while (!ow_done());
-		sleep_cpu();
+	while (!ow_done())
+		sleep_cpu(); /* Worst case, the 1ms tick wakes us up */
 	sleep_disable();
 	return !ow_error();
 }
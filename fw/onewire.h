@@ -1,17 +1,56 @@
 #ifndef ONEWIRE_H_
 #define ONEWIRE_H_
 
-#define OW_MAX_XFER 32
+/*
+ * Select the bus engine:
+ *  0 - Timer0 interrupts four times per bit and samples/drives the line in each phase
+ *  1 - Timer0 only interrupts on edges the master has to drive, received bits are
+ *      decoded from INT1 edge timestamps. Cuts the interrupt load to 1..2 per bit.
+ */
+#ifndef OW_EDGE_ENGINE
+#define OW_EDGE_ENGINE 1
+#endif
 
-enum ow_state_e { OW_TX, OW_RX, OW_IDLE, OW_ERROR };
+/*
+ * Bus speeds selectable with ow_set_speed(), from the 20kHz every part handles upwards.
+ * The 11AA parts go up to 100kHz, but the interrupt load caps what each engine can keep up with.
+ */
+#define OW_SPEED_DEFAULT 0
+#if OW_EDGE_ENGINE
+#define OW_NUM_SPEEDS 4  /* 20, 30, 40, 50kHz */
+#else
+#define OW_NUM_SPEEDS 3  /* 20, 29, 38kHz */
+#endif
+
+/*
+ * Bytes to send are gathered from a list of segments, so a command header and the caller's
+ * payload go out in one transfer without being copied together first. The sync byte is implicit.
+ */
+struct ow_seg {
+	const uint8_t *buf;
+	uint8_t size;
+};
+
+/* States before OW_TX are timed by the timer interrupt ahead of the transfer itself */
+enum ow_state_e { OW_STANDBY, OW_HEADER, OW_TX, OW_RX, OW_IDLE, OW_ERROR };
 
-extern uint8_t ow_buffer[OW_MAX_XFER];
 extern volatile enum ow_state_e ow_state;
+extern volatile uint16_t ow_isr_count; /* Interrupts spent on the last finished transfer, see ow_isr_cost() */
+extern uint16_t ow_rx_crc;
+
+/*
+ * Receive quality since ow_quality_reset(): bits received and how many of them were marginal.
+ * The four phase engine counts bits without a transition between the phase 1 and phase 3 samples,
+ * the edge engine mid-bit edges that are more than 1/8 bit off the expected time.
+ */
+extern uint16_t ow_rx_bits, ow_rx_marginal;
 
 void ow_init(void);
-void ow_reset(void);
-void ow_start(uint8_t write_size, uint8_t read_size, void *read_buf);
+void ow_set_speed(uint8_t speed);
+void ow_start(const struct ow_seg *segs, uint8_t num_segs, uint16_t read_size, void *read_buf);
 void ow_disconnect(void);
+uint16_t ow_isr_cost(void); /* ow_isr_count, read atomically */
+uint16_t ow_byte_pos(void); /* Byte the current/last transfer is at, 0 = sync byte */
 uint8_t ow_wait(void);
 
 static inline uint8_t ow_done(void)
@@ -24,8 +63,24 @@ static inline uint8_t ow_error(void)
 	return ow_state == OW_ERROR;
 }
 
-#define ow_write(size) ow_start(size, 0, 0)
-#define ow_read(write_size, read_size) ow_start(write_size, read_size, 0)
-#define ow_read_buf(write_size, read_size, buf) ow_start(write_size, read_size, buf)
+/*
+ * CRC16 (as in _crc16_update) over all bytes received since ow_crc_reset(), across transfers.
+ * Data followed by its own CRC in little endian leaves 0.
+ */
+static inline uint16_t ow_crc(void)
+{
+	return ow_rx_crc;
+}
+
+static inline void ow_crc_reset(void)
+{
+	ow_rx_crc = 0xFFFF;
+}
+
+static inline void ow_quality_reset(void)
+{
+	ow_rx_bits = 0;
+	ow_rx_marginal = 0;
+}
 
 #endif /* ONEWIRE_H_ */
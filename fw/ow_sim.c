@@ -0,0 +1,810 @@
+/*
+ * Host side UNI/O bus simulator and throughput benchmark.
+ *
+ * Runs the real onewire.c and mc-eeprom.c against a bit level model of a 11AA160 EEPROM
+ * in virtual time, so bus changes can be checked and benchmarked without hardware.
+ * The AVR registers the bus code touches are plain variables (see sim/). The simulator
+ * advances Timer0, the SCIO line and the EEPROM model one CPU cycle at a time and
+ * dispatches the Timer0 compare and INT1 interrupts like the AVR would.
+ *
+ * Build on the host with "make sim", run "./ow_sim -h" for options.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include "onewire.h"
+#include "mc-eeprom.h"
+
+volatile uint8_t PORTD, PIND, DDRD;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TIMSK0, TIFR0;
+volatile uint8_t EICRA, EIMSK, EIFR;
+volatile uint8_t GTCCR;
+volatile uint8_t SREG;
+volatile uint8_t global_ms_timer;
+
+#define CYCLES_PER_US 16
+#define CYCLES_PER_MS_TICK (250000 * CYCLES_PER_US / 256)  /* panel.c system tick */
+#define SCIO_BIT (1 << PD1)
+
+/* Simulator settings, see usage() */
+static unsigned isr_cost = 60;
+static unsigned main_loop_cost = 400;
+static double nosak_rate = 0.0;
+static double flip_rate = 0.0;
+static unsigned max_kbps = 0;
+static int absent = 0;
+static int verbose = 0;
+static unsigned speed = OW_SPEED_DEFAULT;
+static unsigned mem_size = 2048;
+static unsigned twc_us = 5000;
+
+/* Virtual time in CPU cycles */
+static uint64_t now;
+static uint64_t cpu_busy_until;
+static unsigned prescaler_cnt;
+
+/* Interrupt flags live here, TIFR0/EIFR only see the write-one-to-clear accesses of the firmware */
+static uint8_t tifr0, eifr;
+static uint8_t line_prev;
+
+/* Statistics */
+static unsigned long isr_calls, transfers, contention, model_nosaks, model_reads, model_crrds, model_rdsrs;
+
+static double frand(void)
+{
+	return rand() / (RAND_MAX + 1.0);
+}
+
+/*
+ * 11AA160 model
+ */
+
+#define EEP_SIZE 2048
+#define EEP_PAGE 16
+
+enum {
+	MCMD_READ  = 0x03,
+	MCMD_CRRD  = 0x06,
+	MCMD_WRITE = 0x6C,
+	MCMD_WREN  = 0x96,
+	MCMD_WRDI  = 0x91,
+	MCMD_RDSR  = 0x05,
+	MCMD_WRSR  = 0x6E,
+	MCMD_ERAL  = 0x6D,
+	MCMD_SETAL = 0x67,
+};
+
+enum {
+	MSR_WIP = 1,
+	MSR_WEL = 2,
+	MSR_BP  = 0xC,
+};
+
+enum model_state {
+	ML_NEED_STANDBY,  /* after POR or an error, waits for Tstby high */
+	ML_IDLE,          /* waits for the start header */
+	ML_HEADER_LOW,    /* start header low phase (Thdr) */
+	ML_SYNC,          /* master sends 0x55, measure the bit period */
+	ML_RX_BITS,       /* master sends a byte */
+	ML_TX_BITS,       /* model sends a byte */
+	ML_RX_MAK,        /* master sends MAK */
+	ML_SAK,           /* model sends SAK */
+};
+
+static struct {
+	uint8_t mem[EEP_SIZE];
+	uint8_t status;
+	uint64_t wip_until;
+	uint16_t addr;
+
+	enum model_state state;
+	uint8_t drive, level;         /* output driver */
+	uint64_t low_since, high_since;
+
+	uint32_t period;              /* bit period in cycles, measured from the sync byte */
+	uint64_t mid_ref;             /* time of the last mid-bit edge */
+	uint64_t tx_start;            /* start of the byte or SAK the model is sending */
+	uint64_t sync_first_mid;
+	uint8_t edges, bits, shift, mak, sak, from_master;
+
+	/* byte level protocol */
+	uint8_t byte_idx, cmd, wrsr, page[EEP_PAGE], page_fill;
+	uint16_t wr_addr;
+} m;
+
+static void model_error(const char *why)
+{
+	if (verbose)
+		printf("  [%10.1fus] model: %s (command %02X, byte %u, bit %u)\n", now / (double)CYCLES_PER_US, why, m.cmd, m.byte_idx, m.bits);
+	m.state = ML_NEED_STANDBY;
+	m.drive = 0;
+}
+
+static int write_protected(uint16_t addr)
+{
+	switch (m.status & MSR_BP) {
+	case 0x4:
+		return addr >= mem_size * 3 / 4;
+	case 0x8:
+		return addr >= mem_size / 2;
+	case 0xC:
+		return 1;
+	}
+	return 0;
+}
+
+static void model_write_cycle(void)
+{
+	m.status = (m.status | MSR_WIP) & ~MSR_WEL;
+	m.wip_until = now + (uint64_t)twc_us * CYCLES_PER_US;
+}
+
+/* NoMAK and SAK seen: execute whatever the command staged */
+static void model_end_command(void)
+{
+	uint8_t i;
+
+	if (m.status & MSR_WEL) {
+		switch (m.cmd) {
+		case MCMD_WRITE:
+			if (!m.page_fill)
+				break;
+			for (i = 0; i < m.page_fill; i++) {
+				uint16_t a = (m.wr_addr & ~(EEP_PAGE - 1)) | ((m.wr_addr + i) & (EEP_PAGE - 1));
+				if (!write_protected(a % mem_size))
+					m.mem[a % mem_size] = m.page[i];
+			}
+			model_write_cycle();
+			break;
+		case MCMD_WRSR:
+			m.status = (m.status & ~MSR_BP) | (m.wrsr & MSR_BP);
+			model_write_cycle();
+			break;
+		case MCMD_ERAL:
+		case MCMD_SETAL:
+			if (!(m.status & MSR_BP))
+				memset(m.mem, m.cmd == MCMD_ERAL ? 0x00 : 0xFF, mem_size);
+			model_write_cycle();
+			break;
+		}
+	}
+
+	m.state = ML_IDLE;
+	m.drive = 0;
+}
+
+/* A byte arrived from the master, returns whether to acknowledge it */
+static int model_rx_byte(uint8_t data)
+{
+	uint8_t idx = m.byte_idx++;
+
+	if (idx == 0)
+		return data == 0xA0;
+
+	if (idx == 1) {
+		m.cmd = data;
+		if ((m.status & MSR_WIP) && data != MCMD_RDSR)
+			return 0;
+
+		switch (data) {
+		case MCMD_WREN:
+			m.status |= MSR_WEL;
+			return 1;
+		case MCMD_WRDI:
+			m.status &= ~MSR_WEL;
+			return 1;
+		case MCMD_READ:
+			model_reads++;
+			m.page_fill = 0;
+			return 1;
+		case MCMD_CRRD:
+			model_crrds++;
+			m.page_fill = 0;
+			return 1;
+		case MCMD_RDSR:
+			model_rdsrs++;
+			m.page_fill = 0;
+			return 1;
+		case MCMD_WRITE:
+		case MCMD_WRSR:
+		case MCMD_ERAL:
+		case MCMD_SETAL:
+			m.page_fill = 0;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (m.cmd == MCMD_WRSR) {
+		m.wrsr = data;
+	} else if (idx == 2) {
+		m.addr = data << 8;
+	} else if (idx == 3) {
+		m.addr |= data;
+		m.wr_addr = m.addr;
+	} else if (m.cmd == MCMD_WRITE) {
+		m.page[m.page_fill % EEP_PAGE] = data;
+		if (m.page_fill < EEP_PAGE)
+			m.page_fill++;
+	}
+
+	return 1;
+}
+
+/* Does the current command have the model send the next byte? */
+static int model_sends_next(void)
+{
+	switch (m.cmd) {
+	case MCMD_READ:
+		return m.byte_idx >= 4;
+	case MCMD_CRRD:
+	case MCMD_RDSR:
+		return m.byte_idx >= 2;
+	}
+	return 0;
+}
+
+static void model_start_tx_byte(uint64_t start)
+{
+	uint8_t i;
+
+	if (m.cmd == MCMD_RDSR) {
+		m.shift = m.status;
+	} else {
+		m.shift = m.mem[m.addr % mem_size];
+		m.addr = (m.addr + 1) % mem_size;
+	}
+
+	for (i = 0; i < 8; i++)
+		if (frand() < flip_rate)
+			m.shift ^= 1 << i;
+
+	m.byte_idx++;
+	m.from_master = 0;
+	m.tx_start = start;
+	m.state = ML_TX_BITS;
+}
+
+/* Edge while receiving: returns 1 with the bit value on a mid-bit edge, 0 on a bit boundary */
+static int model_mid_edge(uint8_t level, uint8_t *bit)
+{
+	if ((int64_t)(now - m.mid_ref) < m.period * 3 / 4)
+		return 0;
+
+	m.mid_ref = now;
+	*bit = level;
+	return 1;
+}
+
+static void model_step(uint8_t line, uint8_t edge)
+{
+	uint64_t t;
+	uint8_t bit;
+
+	if ((m.status & MSR_WIP) && now >= m.wip_until)
+		m.status &= ~MSR_WIP;
+
+	if (absent)
+		return;
+
+	switch (m.state) {
+	case ML_NEED_STANDBY:
+		if (line && now - m.high_since >= 600 * CYCLES_PER_US)
+			m.state = ML_IDLE;
+		break;
+
+	case ML_IDLE:
+		if (edge && !line) {
+			if (now - m.high_since >= 10 * CYCLES_PER_US)
+				m.state = ML_HEADER_LOW;
+			else
+				model_error("start header: Tss too short");
+		}
+		break;
+
+	case ML_HEADER_LOW:
+		if (edge && line) {
+			if (now - m.low_since < 5 * CYCLES_PER_US) {
+				model_error("start header: Thdr too short");
+				break;
+			}
+			m.state = ML_SYNC;
+			m.edges = 0;
+			transfers++;
+		}
+		break;
+
+	case ML_SYNC:
+		/* 0x55 has a mid-bit edge in every bit and no edges in between */
+		if (!edge) {
+			if (now - (line ? m.high_since : m.low_since) > 150 * CYCLES_PER_US)
+				model_error("no sync byte after start header");
+			break;
+		}
+		if (m.edges == 0)
+			m.sync_first_mid = now;
+		if (++m.edges < 8)
+			break;
+
+		m.period = (now - m.sync_first_mid) / 7;
+		m.mid_ref = now;
+		if (m.period < 10 * CYCLES_PER_US || m.period > 100 * CYCLES_PER_US) {
+			model_error("bit period out of range");
+		} else if (max_kbps && 1000 * CYCLES_PER_US / m.period > max_kbps) {
+			model_error("bit rate too high for this contact");
+		} else {
+			m.byte_idx = 0xFF; /* marks the sync byte */
+			m.state = ML_RX_MAK;
+		}
+		break;
+
+	case ML_RX_BITS:
+		if (edge && model_mid_edge(line, &bit)) {
+			m.shift = (m.shift << 1) | bit;
+			if (++m.bits == 8) {
+				m.from_master = 1;
+				m.state = ML_RX_MAK;
+			}
+		} else if ((int64_t)(now - m.mid_ref) > m.period * 3 / 2) {
+			model_error("missing mid-bit edge from master");
+		}
+		break;
+
+	case ML_TX_BITS:
+		t = now - m.tx_start;
+		if (t >= 8 * (uint64_t)m.period) {
+			m.drive = 0;
+			m.mid_ref = m.tx_start + 7 * m.period + m.period / 2;
+			m.state = ML_RX_MAK;
+			break;
+		}
+		bit = (m.shift >> (7 - t / m.period)) & 1;
+		m.drive = 1;
+		m.level = (t % m.period < m.period / 2) ? !bit : bit;
+		break;
+
+	case ML_RX_MAK:
+		if (edge && model_mid_edge(line, &bit)) {
+			m.mak = bit;
+			if (m.byte_idx == 0xFF) {
+				/* No SAK for the sync byte, the next byte follows the empty SAK slot */
+				m.byte_idx = 0;
+				m.mid_ref = now + m.period;
+				m.bits = 0;
+				m.state = ML_RX_BITS;
+				break;
+			}
+
+			m.sak = m.from_master ? model_rx_byte(m.shift) : 1;
+			if (m.sak && frand() < nosak_rate) {
+				model_nosaks++;
+				m.sak = 0;
+			}
+			m.tx_start = now + m.period / 2;
+			m.state = ML_SAK;
+		} else if ((int64_t)(now - m.mid_ref) > m.period * 3 / 2) {
+			model_error("missing MAK");
+		}
+		break;
+
+	case ML_SAK:
+		if (now < m.tx_start)
+			break;
+		if (!m.sak) {
+			model_error("NoSAK");
+			break;
+		}
+
+		t = now - m.tx_start;
+		if (t < m.period) {
+			m.drive = 1;
+			m.level = t >= m.period / 2;
+			break;
+		}
+
+		m.drive = 0;
+		m.mid_ref = m.tx_start + m.period / 2;
+		if (!m.mak) {
+			model_end_command();
+		} else if (model_sends_next()) {
+			model_start_tx_byte(m.tx_start + m.period);
+		} else {
+			m.bits = 0;
+			m.state = ML_RX_BITS;
+		}
+		break;
+	}
+}
+
+/*
+ * AVR side: Timer0, INT1 and the SCIO line
+ */
+
+/* Only the edge engine uses INT1 */
+void __attribute__((weak)) INT1_vect(void)
+{
+}
+
+static uint8_t line_level(void)
+{
+	if (DDRD & SCIO_BIT)
+		return !!(PORTD & SCIO_BIT);
+	if (m.drive)
+		return m.level;
+	return !!(PORTD & SCIO_BIT); /* pull-up */
+}
+
+/* Both sides driving different levels, after everybody had a chance to react to the last edge */
+static void check_contention(void)
+{
+	if ((DDRD & SCIO_BIT) && m.drive && !!(PORTD & SCIO_BIT) != m.level) {
+		if (verbose && !contention)
+			printf("  [%10.1fus] first bus contention (model state %u, command %02X, byte %u, bit %u)\n",
+			       now / (double)CYCLES_PER_US, m.state, m.cmd, m.byte_idx, m.bits);
+		contention++;
+	}
+}
+
+static void timer0_tick(void)
+{
+	if ((TCCR0A & 3) == 2 && TCNT0 == OCR0A)
+		TCNT0 = 0; /* CTC */
+	else
+		TCNT0++;
+
+	if (TCNT0 == OCR0A)
+		tifr0 |= 1 << OCF0A;
+}
+
+static void sim_cycle(void)
+{
+	static const unsigned divider[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	unsigned div = divider[TCCR0B & 7];
+	uint8_t line, edge, isc;
+
+	/* Apply write-one-to-clear accesses */
+	tifr0 &= ~TIFR0;
+	TIFR0 = 0;
+	eifr &= ~EIFR;
+	EIFR = 0;
+
+	now++;
+	if (!(now % CYCLES_PER_MS_TICK))
+		global_ms_timer++;
+	if (div && ++prescaler_cnt >= div) {
+		prescaler_cnt = 0;
+		timer0_tick();
+	}
+
+	line = line_level();
+	edge = line != line_prev;
+	if (edge) {
+		isc = (EICRA >> ISC10) & 3;
+		if (isc == 1 || (isc == 2 && !line) || (isc == 3 && line))
+			eifr |= 1 << INTF1;
+		if (line)
+			m.high_since = now;
+		else
+			m.low_since = now;
+	}
+	line_prev = line;
+	PIND = line ? (PIND | SCIO_BIT) : (PIND & ~SCIO_BIT);
+
+	model_step(line, edge);
+	check_contention();
+
+	if (now < cpu_busy_until)
+		return;
+
+	if ((eifr & (1 << INTF1)) && (EIMSK & (1 << INT1))) {
+		eifr &= ~(1 << INTF1);
+		INT1_vect();
+	} else if ((tifr0 & (1 << OCF0A)) && (TIMSK0 & (1 << OCIE0A))) {
+		tifr0 &= ~(1 << OCF0A);
+		TIMER0_COMPA_vect();
+	} else {
+		return;
+	}
+
+	isr_calls++;
+	cpu_busy_until = now + isr_cost;
+}
+
+static void sim_run(uint64_t cycles)
+{
+	while (cycles--)
+		sim_cycle();
+}
+
+void sim_run_us(double us)
+{
+	sim_run((uint64_t)(us * CYCLES_PER_US));
+}
+
+/*
+ * Benchmark
+ */
+
+static volatile uint8_t op_done, op_ok;
+
+static void op_cb(uint8_t success)
+{
+	op_ok = success;
+	op_done = 1;
+}
+
+/* Run the main loop until the EEPROM operation finishes, like main() and key.c do */
+static int run_op_powered(void)
+{
+	uint64_t deadline = now + 1000ULL * 1000 * CYCLES_PER_US;
+
+	while (!op_done && now < deadline) {
+		eep_poll();
+		sim_run(main_loop_cost);
+	}
+
+	return op_done && op_ok;
+}
+
+static int run_op(void)
+{
+	int ok = run_op_powered();
+
+	/* key.c powers the slot down after every access */
+	ow_disconnect();
+	m.state = ML_NEED_STANDBY;
+	m.drive = 0;
+	sim_run(100 * CYCLES_PER_US);
+
+	return ok;
+}
+
+struct result {
+	const char *name;
+	unsigned ops, ok, bad_data, bad_crc;
+	unsigned long bytes, transfers, isrs, rx_bits, rx_marginal;
+	uint64_t cycles;
+};
+
+static void report(const struct result *r)
+{
+	double secs = r->cycles / (CYCLES_PER_US * 1e6);
+
+	printf("%-6s %5u ops %5u ok %4u bad %4u crc | %7.1f B/s  %6.2f ms/op | %5.2f xfers/op  %7.1f ISRs/xfer  %5.1f%% ISR load\n",
+			r->name, r->ops, r->ok, r->bad_data, r->bad_crc,
+			secs > 0 ? r->bytes / secs : 0.0, r->ops ? secs * 1000 / r->ops : 0.0,
+			r->ops ? (double)r->transfers / r->ops : 0.0,
+			r->transfers ? (double)r->isrs / r->transfers : 0.0,
+			r->cycles ? 100.0 * r->isrs * isr_cost / r->cycles : 0.0);
+	printf("%-6s %lu bits received, %lu marginal\n", "", r->rx_bits, r->rx_marginal);
+}
+
+/* Running CRC the receive path should have come up with */
+static uint16_t crc16(const uint8_t *data, uint16_t size)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (size--)
+		crc = _crc16_update(crc, *data++);
+	return crc;
+}
+
+enum { B_READ, B_WRITE, B_UPDATE };
+
+/* B_UPDATE changes one byte of what is in the EEPROM and writes it back with eep_update() */
+static void bench(struct result *r, int mode, unsigned iterations, uint16_t addr, uint16_t size)
+{
+	static uint8_t buf[EEP_SIZE], pattern[EEP_SIZE];
+	unsigned i, j;
+
+	for (i = 0; i < iterations; i++) {
+		unsigned long isr0 = isr_calls, xfer0 = transfers;
+		uint64_t t0 = now;
+		int ok;
+
+		for (j = 0; j < size; j++)
+			pattern[j] = rand();
+		if (mode == B_UPDATE) {
+			memcpy(pattern, m.mem + addr, size);
+			pattern[rand() % size] ^= 0x55;
+		}
+
+		op_done = 0;
+		ow_quality_reset();
+		if (mode == B_WRITE) {
+			eep_write(addr, size, pattern, op_cb);
+		} else if (mode == B_UPDATE) {
+			eep_update(addr, size, pattern, op_cb);
+		} else {
+			memset(buf, 0, size);
+			eep_read(addr, size, buf, op_cb);
+		}
+		ok = run_op();
+
+		r->ops++;
+		r->cycles += now - t0;
+		r->isrs += isr_calls - isr0;
+		r->transfers += transfers - xfer0;
+		r->rx_bits += ow_rx_bits;
+		r->rx_marginal += ow_rx_marginal;
+		if (!ok)
+			continue;
+
+		r->ok++;
+		r->bytes += size;
+		if (mode != B_READ ? memcmp(m.mem + addr, pattern, size) : memcmp(buf, m.mem + addr, size))
+			r->bad_data++;
+		else if (mode == B_READ && ow_crc() != crc16(buf, size))
+			r->bad_crc++;
+	}
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+		"  -n N      iterations per benchmark (default 20)\n"
+		"  -s SIZE   transfer size in bytes (default 41, one key record)\n"
+		"  -a ADDR   EEPROM start address (default 0)\n"
+		"  -c CYC    CPU cycles per interrupt invocation (default %u)\n"
+		"  -l CYC    CPU cycles per main loop iteration (default %u)\n"
+		"  -f P      probability that the model withholds a SAK, per byte\n"
+		"  -b P      probability that a bit sent by the model gets flipped\n"
+		"  -m KBPS   model fails transfers faster than KBPS (worn contact)\n"
+		"  -x        no EEPROM on the bus\n"
+		"  -S SPEED  bus speed index, 0..%d\n"
+		"  -z SIZE   EEPROM size in bytes, 128 (11AA010) to 2048 (11AA160)\n"
+		"  -w US     EEPROM write cycle time (default %u)\n"
+		"  -r SEED   random seed\n"
+		"  -v        trace model errors\n", name, isr_cost, main_loop_cost, OW_NUM_SPEEDS - 1, twc_us);
+}
+
+static int mem_is(uint8_t value)
+{
+	unsigned i;
+
+	for (i = 0; i < mem_size; i++)
+		if (m.mem[i] != value)
+			return 0;
+	return 1;
+}
+
+/* Check the commands the benchmark doesn't exercise: ERAL, SETAL, WRSR and write protection */
+static int selftest(void)
+{
+	static uint8_t pattern[EEP_PAGE], buf[100];
+	int ok = 1;
+
+	op_done = 0;
+	eep_detect(op_cb);
+	ok &= run_op() && eep_size(eep_type()) == mem_size;
+
+	/* Streaming read, the second half continues with a current address read */
+	op_done = 0;
+	eep_read(3, 50, buf, op_cb);
+	ok &= run_op_powered();
+	op_done = 0;
+	eep_read_next(50, buf + 50, op_cb);
+	ok &= run_op() && !memcmp(buf, m.mem + 3, sizeof(buf)) && ow_crc() == crc16(buf, sizeof(buf));
+
+	op_done = 0;
+	eep_erase(EEP_ERASE_FF, op_cb);
+	ok &= run_op() && mem_is(0xFF);
+
+	op_done = 0;
+	eep_erase(EEP_ERASE_00, op_cb);
+	ok &= run_op() && mem_is(0x00);
+
+	op_done = 0;
+	eep_protect(EEP_PROT_ALL, op_cb);
+	ok &= run_op();
+
+	memset(pattern, 0x5A, sizeof(pattern));
+	op_done = 0;
+	eep_write(0, sizeof(pattern), pattern, op_cb);
+	ok &= run_op() && mem_is(0x00);
+
+	op_done = 0;
+	eep_protect(EEP_PROT_NONE, op_cb);
+	ok &= run_op();
+
+	op_done = 0;
+	eep_write(0, sizeof(pattern), pattern, op_cb);
+	ok &= run_op() && !memcmp(m.mem, pattern, sizeof(pattern));
+
+	/* Update over three pages, only the one with a change gets written */
+	memcpy(buf, m.mem + 8, 40);
+	op_done = 0;
+	eep_update(8, 40, buf, op_cb);
+	ok &= run_op() && eep_pages_written() == 0 && eep_pages_skipped() == 3;
+	buf[20]++;
+	op_done = 0;
+	eep_update(8, 40, buf, op_cb);
+	ok &= run_op() && eep_pages_written() == 1 && eep_pages_skipped() == 2 && !memcmp(m.mem + 8, buf, 40);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	struct result rd = { "read" }, wr = { "write" }, upd = { "update" };
+	unsigned iterations = 20, size = 41, addr = 0, i;
+	uint64_t t0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:a:c:l:f:b:m:xS:z:w:r:vh")) != -1) {
+		switch (opt) {
+		case 'n': iterations = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'a': addr = atoi(optarg); break;
+		case 'c': isr_cost = atoi(optarg); break;
+		case 'l': main_loop_cost = atoi(optarg); break;
+		case 'f': nosak_rate = atof(optarg); break;
+		case 'b': flip_rate = atof(optarg); break;
+		case 'm': max_kbps = atoi(optarg); break;
+		case 'x': absent = 1; break;
+		case 'S': speed = atoi(optarg); break;
+		case 'z': mem_size = atoi(optarg); break;
+		case 'w': twc_us = atoi(optarg); break;
+		case 'r': srand(atoi(optarg)); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]); return opt != 'h';
+		}
+	}
+
+	if (speed >= OW_NUM_SPEEDS) {
+		fprintf(stderr, "Speed must be 0..%d\n", OW_NUM_SPEEDS - 1);
+		return 1;
+	}
+
+	if (mem_size < 128 || mem_size > EEP_SIZE || (mem_size & (mem_size - 1))) {
+		fprintf(stderr, "EEPROM size must be a power of two from 128 to %d\n", EEP_SIZE);
+		return 1;
+	}
+
+	if (!size || addr + size > mem_size) {
+		fprintf(stderr, "Transfer must fit into the %u byte EEPROM\n", mem_size);
+		return 1;
+	}
+
+	for (i = 0; i < EEP_SIZE; i++)
+		m.mem[i] = rand();
+	m.state = ML_NEED_STANDBY;
+
+	ow_init();
+	ow_set_speed(speed);
+	sim_run(1000 * CYCLES_PER_US);
+
+	if (!nosak_rate && !flip_rate && !max_kbps && !absent) {
+		if (!selftest()) {
+			printf("selftest FAILED\n");
+			return 2;
+		}
+		printf("selftest OK\n");
+	}
+
+	for (i = 0; i < EEP_SIZE; i++)
+		m.mem[i] = rand();
+
+	/* Idle bus cost, for comparison */
+	t0 = now;
+	isr_calls = 0;
+	sim_run(10000 * CYCLES_PER_US);
+	printf("idle   %7.1f ISRs/ms\n", isr_calls / ((now - t0) / (CYCLES_PER_US * 1000.0)));
+
+	bench(&rd, B_READ, iterations, addr, size);
+	bench(&wr, B_WRITE, iterations, addr, size);
+	bench(&upd, B_UPDATE, iterations, addr, size);
+	report(&rd);
+	report(&wr);
+	report(&upd);
+	printf("model NoSAKs injected: %lu, bus contention cycles: %lu, READ/CRRD/RDSR commands: %lu/%lu/%lu\n",
+			model_nosaks, contention, model_reads, model_crrds, model_rdsrs);
+
+	return (rd.ok == rd.ops && wr.ok == wr.ops && upd.ok == upd.ops && !rd.bad_data && !wr.bad_data && !upd.bad_data) ? 0 : 2;
+}
@@ -12,7 +12,7 @@
 #include "lcd_drv.h"
 
 struct shiftregs shiftregs = {
-	0, 1, 0, 0, 0, 0
+	.bank = { [0 ... KEY_BANKS - 1] = { .key_en = 1 } },
 };
 
 #define shiftreg_bytes ((uint8_t *)&shiftregs)
@@ -22,7 +22,7 @@ uint8_t shiftreg_state;
 ISR(SPI_STC_vect)
 {
 	shiftreg_state++;
-	if (shiftreg_state < 2)
+	if (shiftreg_state < sizeof(shiftregs))
 		SPDR = shiftreg_bytes[shiftreg_state];
 	else {
 		SHIFTREG_LATCH = 1;
@@ -35,14 +35,14 @@ ISR(SPI_STC_vect)
 
 static void shiftreg_reset(void)
 {
-	uint8_t dummy __attribute__((unused));
+	uint8_t i, dummy __attribute__((unused));
 
 	SPSR = 0;
 	SPCR = SPI_SETTINGS;
-	SPDR = 0;
-	while (!(SPSR & (1 << SPIF)));
-	SPDR = 0;
-	while (!(SPSR & (1 << SPIF)));
+	for (i = 0; i < sizeof(shiftregs); i++) {
+		SPDR = 0;
+		while (!(SPSR & (1 << SPIF)));
+	}
 	dummy = SPDR; // read SPDR to clear SPIF
 	SHIFTREG_LATCH = 1;
 	SPCR = 0;
@@ -341,14 +341,31 @@ void smaul_off(void)
 	set_smaul_led(0);
 }
 
-static volatile uint8_t led_blink_mask = 0;
+static volatile key_mask_t led_blink_mask = 0;
+
+/* Call with interrupts off */
+static void keyleds_toggle(key_mask_t mask)
+{
+	uint8_t bank;
+
+	for (bank = 0; bank < KEY_BANKS; bank++, mask >>= 8)
+		shiftreg_bank(bank)->leds ^= mask;
+}
+
+static void keyleds_clear(void)
+{
+	uint8_t bank;
+
+	for (bank = 0; bank < KEY_BANKS; bank++)
+		shiftreg_bank(bank)->leds = 0;
+}
 
 static void keyleds_update(void)
 {
-	uint8_t led_blink_mask_copy = led_blink_mask;
+	key_mask_t led_blink_mask_copy = led_blink_mask;
 	if (led_blink_mask_copy && (global_qs_timer & 1)) {
 		cli();
-		shiftregs.leds ^= led_blink_mask_copy;
+		keyleds_toggle(led_blink_mask_copy);
 		sei();
 		shiftreg_update();
 	}
@@ -356,9 +373,10 @@ static void keyleds_update(void)
 
 void keyled_on(uint8_t which)
 {
-	led_blink_mask = 0;
 	cli();
-	shiftregs.leds = 1 << which;
+	led_blink_mask = 0;
+	keyleds_clear();
+	keyleds_toggle((key_mask_t)1 << which);
 	sei();
 	shiftreg_update();
 }
@@ -366,22 +384,23 @@ void keyled_on(uint8_t which)
 void keyled_blink(uint8_t which)
 {
 	cli();
-	shiftregs.leds = 0;
+	keyleds_clear();
+	led_blink_mask = (key_mask_t)1 << which;
 	sei();
-	led_blink_mask = 1 << which;
 }
 
 void keyleds_off(void)
 {
-	led_blink_mask = 0;
 	cli();
-	shiftregs.leds = 0;
+	led_blink_mask = 0;
+	keyleds_clear();
 	sei();
 	shiftreg_update();
 }
 
 #define LCD_WIDTH 16
-#define MAX_LCD_LINE1 (MAX_KEYS + 1) * (NAME_LENGTH + 2)
+/* Room for 8 names, print_missing_keys() sums up the rest. Line lengths have to fit a byte. */
+#define MAX_LCD_LINE1 (min(MAX_KEYS, 8) + 1) * (NAME_LENGTH + 2)
 #define MAX_LCD_LINE2 LCD_WIDTH + 1
 #define SCROLL_NUM_SPACES 3
 #define SCROLL_SPEED 3
@@ -419,6 +438,9 @@ void lcd_print_update_P(uint8_t line, const char *fmt, ...)
 	va_start(varargs, fmt);
 	l->len += vsnprintf_P(l->text + l->len, max_line_length(line) - l->len, fmt, varargs);
 	va_end(varargs);
+
+	/* vsnprintf_P returns what it would have written, not what fit */
+	l->len = min(l->len, max_line_length(line) - 1);
 }
 
 void lcd_print_end(uint8_t line)
@@ -447,7 +469,8 @@ void lcd_printfP(uint8_t line, const char *fmt, ...)
 
 	lcd_print_start(line);
 	va_start(varargs, fmt);
-	lcd_lines[line].len = vsnprintf_P(lcd_lines[line].text, max_line_length(line), fmt, varargs);
+	lcd_lines[line].len = min(vsnprintf_P(lcd_lines[line].text, max_line_length(line), fmt, varargs),
+			max_line_length(line) - 1);
 	va_end(varargs);
 	lcd_print_end(line);
 }
@@ -513,6 +536,37 @@ ISR(TIMER3_OVF_vect)
 	}
 }
 
+/* An overflow not handled yet belongs to the timer value if that has just wrapped */
+static uint8_t tick_pending(uint8_t t)
+{
+	return (TIFR3 & (1 << TOV3)) && t < 128;
+}
+
+uint16_t get_ms_timer(void)
+{
+	uint8_t sreg = SREG;
+	uint16_t ms;
+
+	cli();
+	ms = (global_qs_timer << 8) | global_ms_timer;
+	ms += tick_pending(TCNT3L);
+	SREG = sreg;
+	return ms;
+}
+
+uint16_t get_fine_timer(void)
+{
+	uint8_t sreg = SREG;
+	uint8_t ms, t;
+
+	cli();
+	ms = global_ms_timer;
+	t = TCNT3L;
+	ms += tick_pending(t);
+	SREG = sreg;
+	return (ms << 8) | t;
+}
+
 void panel_init(void)
 {
 	lcd_printfP(0, PSTR(""));
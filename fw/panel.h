@@ -10,11 +10,17 @@
 extern struct shiftregs shiftregs;
 void shiftreg_update(void);
 
+/* Bank 0 is the main board, bank 1 the first extension and so on */
+static inline struct shiftreg_bank *shiftreg_bank(uint8_t bank)
+{
+	return &shiftregs.bank[KEY_BANKS - 1 - bank];
+}
+
 #ifndef __NO_INCLUDE_AVR
 static inline uint8_t shiftreg_done(void)
 {
 	extern uint8_t shiftreg_state;
-	return (shiftreg_state >= 2);
+	return (shiftreg_state >= sizeof(struct shiftregs));
 }
 
 static inline void set_lcd_led(uint8_t value)
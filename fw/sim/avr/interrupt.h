@@ -0,0 +1,16 @@
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+/* Interrupt handlers become plain functions that the simulator dispatches */
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+void TIMER0_COMPA_vect(void);
+void INT1_vect(void);
+
+/* Interrupts only ever run between simulated main loop steps, so there is nothing to lock */
+#define cli() do { } while (0)
+#define sei() do { } while (0)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,30 @@
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+/*
+ * Host build shim: just the ATmega32u4 registers the bus code touches, backed by
+ * plain variables that ow_sim.c watches and updates.
+ */
+
+#include <stdint.h>
+
+extern volatile uint8_t PORTD, PIND, DDRD;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TIMSK0, TIFR0;
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+extern volatile uint8_t GTCCR;
+extern volatile uint8_t SREG;
+
+#define PD0 0
+#define PD1 1
+
+#define WGM00  0
+#define WGM01  1
+#define CS00   0
+#define OCIE0A 1
+#define OCF0A  1
+#define ISC10  2
+#define INT1   1
+#define INTF1  1
+#define PSRSYNC 0
+
+#endif /* SIM_AVR_IO_H_ */
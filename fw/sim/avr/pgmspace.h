@@ -0,0 +1,12 @@
+#ifndef SIM_AVR_PGMSPACE_H_
+#define SIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+/* Host build shim: there is only one address space */
+#define PROGMEM
+#define PSTR(str) str
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+#endif /* SIM_AVR_PGMSPACE_H_ */
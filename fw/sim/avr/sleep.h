@@ -0,0 +1,10 @@
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+void sim_run_us(double us);
+
+#define sleep_enable()  do { } while (0)
+#define sleep_disable() do { } while (0)
+#define sleep_cpu()     sim_run_us(1)
+
+#endif /* SIM_AVR_SLEEP_H_ */
@@ -0,0 +1,10 @@
+#ifndef SIM_UTIL_DELAY_H_
+#define SIM_UTIL_DELAY_H_
+
+/* Busy waits burn virtual time, interrupts keep running meanwhile */
+void sim_run_us(double us);
+
+#define _delay_us(us) sim_run_us(us)
+#define _delay_ms(ms) sim_run_us((ms) * 1000.0)
+
+#endif /* SIM_UTIL_DELAY_H_ */
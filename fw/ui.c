@@ -31,11 +31,7 @@ static int16_t getMinimumTimer(uint8_t limit)
 
 static uint8_t isAnyKeyMissing(void)
 {
-	uint8_t i;
-	for (i = 0; i < MAX_KEYS; i++)
-		if (isKeyMissing(i))
-			return 1;
-	return 0;
+	return keyMissing != 0;
 }
 
 static void print_time(int16_t timeInSeconds)
@@ -94,6 +90,39 @@ void keytimer_display_update(void)
 	lcd_print_end(1);
 }
 
+/* d is NULL while the key's names are being fetched */
+static void print_key_error(const struct key_eeprom_data *d) {
+	switch (ui_flags & UIF_KEY_ERROR) {
+	case UIF_KEY_ERROR_READ_ERR:
+		lcd_printfP(0, PSTR("Error reading key"));
+		break;
+	case UIF_KEY_ERROR_UNKNOWN:
+		if (d)
+			lcd_printfP(0, PSTR("Unknown key %d (\"%s\")"), d->key.id, d->key.name);
+		else
+			lcd_printfP(0, PSTR("Unknown key %d"), keys[error_slot].rec.key_id);
+		break;
+	case UIF_KEY_ERROR_OTHER_KB:
+		if (d)
+			lcd_printfP(0, PSTR("Key belongs to %s keyboard"), d->kb.name);
+		else
+			lcd_printfP(0, PSTR("Key belongs to keyboard %d"), keys[error_slot].rec.kb_id);
+		break;
+	}
+}
+
+/* Names of keys we don't know from the config have to come from the key itself */
+static void ui_fetch_cb(uint8_t slot, uint8_t status, const struct key_eeprom_data *d) {
+	/* Moved on while this was under way, the fetch for the current key comes next */
+	if (!d || (ui_state == UIS_FIND_KEY && slot != selected_key))
+		return;
+
+	if (ui_state == UIS_FIND_KEY)
+		lcd_printfP(1, PSTR("%s"), d->key.name);
+	else if (ui_state == UIS_KEY_ERROR && slot == error_slot)
+		print_key_error(d);
+}
+
 static void ui_repaint(void) {
 	uint8_t n;
 
@@ -128,9 +157,17 @@ static void ui_repaint(void) {
 		break;
 
 	case UIS_FIND_KEY:
-		if (keys[selected_key].state == KS_VALID)
-			lcd_printfP(1, PSTR("%s"), keys[selected_key].eep.key.name);
-		else
+		if (keys[selected_key].state == KS_VALID) {
+			struct key_record *r = &keys[selected_key].rec;
+			int8_t config_idx = (r->kb_id == config.kb.id) ? find_key(r->key_id) : -1;
+
+			if (config_idx >= 0) {
+				lcd_printfP(1, PSTR("%s"), config.keys[config_idx].name);
+			} else {
+				lcd_printfP(1, PSTR("Key %d"), r->key_id);
+				key_fetch(selected_key, ui_fetch_cb);
+			}
+		} else
 			lcd_printfP(1, (keys[selected_key].state == KS_EMPTY) ? PSTR("No key plugged") : PSTR("Read error"));
 		keyled_on(selected_key);
 		break;
@@ -162,17 +199,26 @@ static void reset_ui_timer(void) {
 	}
 }
 
+/* The LCD line has room for 8 names */
+#define MAX_MISSING_NAMES 8
+
 static void print_missing_keys(void) {
-	uint8_t i, first = 1;
+	uint8_t i, shown = 0, more = 0;
 
 	lcd_print_start(0);
 	for (i = 0; i < MAX_KEYS; i++) {
-		if (isKeyMissing(i)) {
-			lcd_print_update_P(0, first ? PSTR("Missing: ") : PSTR(", "));
-			first = 0;
-			lcd_print_update_P(0, PSTR("%s"), config.keys[i].name);
+		if (!isKeyMissing(i))
+			continue;
+		if (shown == MAX_MISSING_NAMES) {
+			more++;
+			continue;
 		}
+		lcd_print_update_P(0, shown ? PSTR(", ") : PSTR("Missing: "));
+		lcd_print_update_P(0, PSTR("%s"), config.keys[i].name);
+		shown++;
 	}
+	if (more)
+		lcd_print_update_P(0, PSTR(" +%d more"), more);
 	lcd_print_end(0);
 }
 
@@ -185,17 +231,9 @@ static void ui_default_state(void) {
 		smaul_pulse_update();
 		beeper_start(BEEP_ERROR);
 
-		switch (ui_flags & UIF_KEY_ERROR) {
-		case UIF_KEY_ERROR_READ_ERR:
-			lcd_printfP(0, PSTR("Error reading key"));
-			break;
-		case UIF_KEY_ERROR_UNKNOWN:
-			lcd_printfP(0, PSTR("Unknown key %d (\"%s\")"), keys[error_slot].eep.key.id, keys[error_slot].eep.key.name);
-			break;
-		case UIF_KEY_ERROR_OTHER_KB:
-			lcd_printfP(0, PSTR("Key belongs to %s keyboard"), keys[error_slot].eep.kb.name);
-			break;
-		}
+		print_key_error(NULL);
+		if (ui_flags & (UIF_KEY_ERROR_UNKNOWN | UIF_KEY_ERROR_OTHER_KB))
+			key_fetch(error_slot, ui_fetch_cb);
 	} else {
 		ui_state = UIS_IDLE;
 		keyleds_off();